@@ -0,0 +1,69 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bench.h"
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_init(bench_t *b)
+{
+    b->fd = -1;
+    b->ns = 0;
+    b->cache_misses = -1;
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* Virtual machines and containers often do not allow this */
+    b->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+void bench_start(bench_t *b)
+{
+#if defined(__linux__)
+    if (b->fd >= 0) {
+        ioctl(b->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(b->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    b->start = now_ns();
+}
+
+void bench_stop(bench_t *b)
+{
+    b->ns = now_ns() - b->start;
+    b->cache_misses = -1;
+#if defined(__linux__)
+    if (b->fd >= 0) {
+        uint64_t count;
+        ioctl(b->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(b->fd, &count, sizeof(count)) == sizeof(count))
+            b->cache_misses = count;
+    }
+#endif
+}
+
+void bench_exit(bench_t *b)
+{
+    if (b->fd >= 0)
+        close(b->fd);
+    b->fd = -1;
+}
@@ -0,0 +1,29 @@
+#ifndef LAB0_BENCH_H
+#define LAB0_BENCH_H
+
+#include <stdint.h>
+
+/* Measure how long a piece of code takes and, where the kernel exposes
+ * hardware counters to us, how many cache misses it causes.
+ */
+
+typedef struct {
+    int fd;         /* perf event counting cache misses, -1 if unavailable */
+    uint64_t start; /* timestamp of bench_start(), in nanoseconds */
+    uint64_t ns;    /* elapsed time of the last measurement */
+    int64_t cache_misses; /* cache misses of the last measurement, or -1 */
+} bench_t;
+
+/* Prepare a measurement, opening the cache miss counter if possible */
+void bench_init(bench_t *b);
+
+/* Start measuring */
+void bench_start(bench_t *b);
+
+/* Stop measuring and record the results in @b */
+void bench_stop(bench_t *b);
+
+/* Release the resources held by @b */
+void bench_exit(bench_t *b);
+
+#endif /* LAB0_BENCH_H */
@@ -0,0 +1,1054 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "element.h"
+
+/* Allocate elements of newly created queues from a per-queue slab */
+int q_use_slab = 0;
+
+/* Share one copy of equal strings that do not fit inline */
+int q_intern = 0;
+
+/* Let the cached prefixes decide comparisons whenever they can */
+int q_cmp_prefix = 1;
+
+/* Compare the strings with memcmp() */
+int q_cmp_simd = 0;
+
+/* Let q_sort() of the list backend use its default algorithm */
+int q_sortalgo = 0;
+
+/* Sort on the calling thread only */
+int q_sort_threads = 1;
+
+/* Only delete adjacent duplicates */
+int q_dedup_hash = 0;
+
+/* Merge the whole chain at once on the calling thread */
+int q_merge_threads = 1;
+
+/* Prefetch ahead of the walks along lists */
+int q_prefetch = 1;
+
+/* Walk to the elements found by position */
+int q_index = 0;
+
+_Thread_local q_stats_t q_stats;
+
+/* Slab chunks start on a cache line boundary */
+#define SLAB_ALIGN 64
+
+/* Number of elements in the first chunk of a slab. Each further chunk doubles
+ * in size until SLAB_MAX_NODES is reached.
+ */
+#define SLAB_MIN_NODES 32
+#define SLAB_MAX_NODES 4096
+
+struct slab_chunk {
+    struct slab_chunk *next;
+    /* Followed by the elements, starting at the next SLAB_ALIGN boundary */
+};
+
+/**
+ * struct slab - Allocator handing out elements of a single queue
+ * @chunks: all chunks obtained so far, newest first
+ * @free_list: recycled elements, linked through list.next
+ * @next: first never used element in the newest chunk
+ * @end: end of the newest chunk
+ * @live: number of elements handed out and not yet released
+ * @nr_free: number of elements on @free_list
+ * @chunk_nodes: capacity of the next chunk
+ * @orphan: the owning queue has been freed
+ *
+ * Elements may outlive their queue, e.g. after q_merge() moved them to another
+ * queue. An orphaned slab is therefore destroyed only when @live drops to 0.
+ */
+struct slab {
+    struct slab_chunk *chunks;
+    element_t *free_list;
+    element_t *next, *end;
+    size_t live;
+    size_t nr_free;
+    size_t chunk_nodes;
+    bool orphan;
+};
+
+struct slab *slab_new()
+{
+    struct slab *slab = malloc(sizeof(struct slab));
+    if (!slab)
+        return NULL;
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+    slab->next = slab->end = NULL;
+    slab->live = 0;
+    slab->nr_free = 0;
+    slab->chunk_nodes = SLAB_MIN_NODES;
+    slab->orphan = false;
+    return slab;
+}
+
+static void slab_destroy(struct slab *slab)
+{
+    struct slab_chunk *chunk = slab->chunks;
+    while (chunk) {
+        struct slab_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(slab);
+}
+
+/* Add a chunk able to hold @nodes elements to @slab */
+static bool slab_grow(struct slab *slab, size_t nodes)
+{
+    struct slab_chunk *chunk = malloc(sizeof(struct slab_chunk) + SLAB_ALIGN -
+                                      1 + nodes * sizeof(element_t));
+    if (!chunk)
+        return false;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    uintptr_t base = (uintptr_t) (chunk + 1);
+    base = (base + SLAB_ALIGN - 1) & ~(uintptr_t) (SLAB_ALIGN - 1);
+    slab->next = (element_t *) base;
+    slab->end = slab->next + nodes;
+    return true;
+}
+
+bool slab_reserve(struct slab *slab, size_t n)
+{
+    size_t avail = slab->nr_free + (size_t) (slab->end - slab->next);
+    if (avail >= n)
+        return true;
+
+    /* The new chunk replaces the current one, whose unused tail would be lost
+     * unless it goes to the free list first, from its end so that it is
+     * handed out in address order.
+     */
+    while (slab->end != slab->next) {
+        element_t *e = --slab->end;
+        e->list.next = (struct list_head *) slab->free_list;
+        slab->free_list = e;
+        slab->nr_free++;
+    }
+    return slab_grow(slab, n - avail);
+}
+
+struct slab *slab_batch_begin(struct slab *slab, size_t n)
+{
+    if (!slab) {
+        slab = slab_new();
+        if (!slab)
+            return NULL;
+    }
+    /* On failure slab_get() still falls back to regular chunks */
+    slab_reserve(slab, n);
+    return slab;
+}
+
+void slab_batch_end(struct slab *slab, struct slab *batch)
+{
+    if (batch && batch != slab)
+        slab_orphan(batch);
+}
+
+static element_t *slab_get(struct slab *slab)
+{
+    element_t *e = slab->free_list;
+    if (e) {
+        slab->free_list = (element_t *) e->list.next;
+        slab->nr_free--;
+    } else {
+        if (slab->next == slab->end) {
+            if (!slab_grow(slab, slab->chunk_nodes))
+                return NULL;
+            if (slab->chunk_nodes < SLAB_MAX_NODES)
+                slab->chunk_nodes <<= 1;
+        }
+        e = slab->next++;
+    }
+    slab->live++;
+    e->slab = slab;
+    return e;
+}
+
+static void slab_put(struct slab *slab, element_t *e)
+{
+    e->list.next = (struct list_head *) slab->free_list;
+    slab->free_list = e;
+    slab->nr_free++;
+    if (!--slab->live && slab->orphan)
+        slab_destroy(slab);
+}
+
+/**
+ * struct intern_entry - String shared by all elements holding the same value
+ * @next: next entry in the same bucket
+ * @refcnt: number of elements pointing to @str
+ * @hash: hash of @str
+ * @str: the string itself, which element_t.value points to
+ */
+struct intern_entry {
+    struct intern_entry *next;
+    size_t refcnt;
+    uint32_t hash;
+    char str[];
+};
+
+/* Hash table of interned strings. The bucket array is released as soon as the
+ * last string is, so an idle pool holds no memory.
+ */
+#define INTERN_MIN_BUCKETS 64
+
+static struct {
+    struct intern_entry **buckets;
+    size_t nr_buckets;
+    size_t count;
+} pool;
+
+/* FNV-1a */
+static uint32_t intern_hash(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Double the number of buckets. Failing is harmless, chains just get longer */
+static void intern_grow()
+{
+    size_t nr = pool.nr_buckets ? pool.nr_buckets << 1 : INTERN_MIN_BUCKETS;
+    struct intern_entry **buckets = calloc(nr, sizeof(*buckets));
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; i < pool.nr_buckets; i++) {
+        struct intern_entry *entry = pool.buckets[i];
+        while (entry) {
+            struct intern_entry *next = entry->next;
+            size_t b = entry->hash & (nr - 1);
+            entry->next = buckets[b];
+            buckets[b] = entry;
+            entry = next;
+        }
+    }
+    free(pool.buckets);
+    pool.buckets = buckets;
+    pool.nr_buckets = nr;
+}
+
+/* Return the shared copy of @s of @len characters, NULL if out of memory */
+static char *intern_get(const char *s, size_t len)
+{
+    uint32_t hash = intern_hash(s, len);
+    if (pool.buckets) {
+        struct intern_entry *entry = pool.buckets[hash & (pool.nr_buckets - 1)];
+        for (; entry; entry = entry->next) {
+            if (entry->hash == hash && !memcmp(entry->str, s, len) &&
+                !entry->str[len]) {
+                entry->refcnt++;
+                return entry->str;
+            }
+        }
+    }
+
+    if (pool.count >= pool.nr_buckets)
+        intern_grow();
+    if (!pool.buckets)
+        return NULL;
+
+    struct intern_entry *entry = malloc(sizeof(*entry) + len + 1);
+    if (!entry)
+        return NULL;
+    entry->refcnt = 1;
+    entry->hash = hash;
+    memcpy(entry->str, s, len);
+    entry->str[len] = '\0';
+
+    size_t b = hash & (pool.nr_buckets - 1);
+    entry->next = pool.buckets[b];
+    pool.buckets[b] = entry;
+    pool.count++;
+    return entry->str;
+}
+
+static void intern_put(char *str)
+{
+    struct intern_entry *entry =
+        (struct intern_entry *) (str - offsetof(struct intern_entry, str));
+    if (--entry->refcnt)
+        return;
+
+    struct intern_entry **pp =
+        &pool.buckets[entry->hash & (pool.nr_buckets - 1)];
+    while (*pp != entry)
+        pp = &(*pp)->next;
+    *pp = entry->next;
+    free(entry);
+
+    if (!--pool.count) {
+        free(pool.buckets);
+        pool.buckets = NULL;
+        pool.nr_buckets = 0;
+    }
+}
+
+void element_free_value(element_t *e)
+{
+    /* Strings kept inline, or in the tail of the element, go away with it */
+    if (e->value == e->data || e->value == (char *) (e + 1))
+        return;
+    if (e->interned)
+        intern_put(e->value);
+    else
+        free(e->value);
+}
+
+element_t *element_new(struct slab *slab, const char *s, size_t len)
+{
+    if (len > UINT32_MAX)
+        return NULL;
+
+    /* Without a slab, whose elements all have the same size, a long string
+     * that is not interned follows its element in the same allocation.
+     */
+    bool tail = !slab && !q_intern && len > sizeof(((element_t *) 0)->data);
+    element_t *e;
+    if (slab) {
+        e = slab_get(slab);
+    } else {
+        e = malloc(sizeof(element_t) + (tail ? len : 0));
+        if (e)
+            e->slab = NULL;
+    }
+    if (!e)
+        return NULL;
+
+    e->len = len - 1;
+    e->prefix = string_prefix(s, len - 1);
+    e->interned = false;
+    if (len <= sizeof(e->data)) {
+        e->value = memcpy(e->data, s, len);
+        return e;
+    }
+    if (tail) {
+        e->value = memcpy(e + 1, s, len);
+        return e;
+    }
+
+    if (q_intern) {
+        e->value = intern_get(s, len - 1);
+        if (!e->value) {
+            e->value = e->data;
+            q_release_element(e);
+            return NULL;
+        }
+        e->interned = true;
+        return e;
+    }
+
+    e->value = malloc(len);
+    if (!e->value) {
+        e->value = e->data;
+        q_release_element(e);
+        return NULL;
+    }
+    memcpy(e->value, s, len);
+    return e;
+}
+
+/* Release an element, returning it to its slab if it came from one */
+void q_release_element(element_t *e)
+{
+    element_free_value(e);
+    if (e->slab)
+        slab_put(e->slab, e);
+    else
+        free(e);
+}
+
+void element_discard(element_t *e, struct slab *slab)
+{
+    if (slab && e->slab == slab) {
+        element_free_value(e);
+        slab->live--;
+    } else {
+        q_release_element(e);
+    }
+}
+
+void slab_orphan(struct slab *slab)
+{
+    slab->orphan = true;
+    if (!slab->live)
+        slab_destroy(slab);
+}
+
+void element_shuffle_slots(element_t **slots, int n, uint64_t *state)
+{
+    for (int i = n - 1; i > 0; i--) {
+        int j = rng_below(state, i + 1);
+        element_t *e = slots[i];
+        slots[i] = slots[j];
+        slots[j] = e;
+    }
+}
+
+bool element_list_shuffle(struct list_head *head, int n, uint64_t seed)
+{
+    if (n < 2)
+        return true;
+    element_t **slots = malloc(n * sizeof(*slots));
+    if (!slots)
+        return false;
+
+    int i = 0;
+    element_t *e;
+    list_for_each_entry (e, head, list)
+        slots[i++] = e;
+    uint64_t state = rng_seed(seed);
+    element_shuffle_slots(slots, n, &state);
+
+    struct list_head *prev = head;
+    for (i = 0; i < n; i++) {
+        prev->next = &slots[i]->list;
+        slots[i]->list.prev = prev;
+        prev = &slots[i]->list;
+    }
+    prev->next = head;
+    head->prev = prev;
+    free(slots);
+    return true;
+}
+
+bool dup_set_init(struct dup_set *set, int n)
+{
+    size_t nr = 16;
+    while (nr < 2 * (size_t) n)
+        nr <<= 1;
+    set->slots = calloc(nr, sizeof(*set->slots));
+    set->mask = nr - 1;
+    return set->slots;
+}
+
+void dup_set_exit(struct dup_set *set)
+{
+    free(set->slots);
+}
+
+struct dup_slot *dup_set_find(struct dup_set *set, element_t *e)
+{
+    uint64_t hash = element_hash(e);
+    for (size_t i = hash & set->mask;; i = (i + 1) & set->mask) {
+        struct dup_slot *slot = &set->slots[i];
+        if (!slot->e) {
+            *slot = (struct dup_slot){e, hash >> 32, 0};
+            return slot;
+        }
+        if (slot->hash == (uint32_t) (hash >> 32) && element_equal(slot->e, e))
+            return slot;
+    }
+}
+
+struct list_head *element_merge(struct list_head *a,
+                                struct list_head *b,
+                                bool descend)
+{
+    struct list_head *head = NULL, **tail = &head;
+    while (a && b) {
+        if (element_before(list_entry(b, element_t, list),
+                           list_entry(a, element_t, list), descend)) {
+            element_prefetch_merge(b, a);
+            *tail = b;
+            b = b->next;
+        } else {
+            element_prefetch_merge(a, b);
+            *tail = a;
+            a = a->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+void element_sort_slots(element_t **slots, int n, bool descend)
+{
+    for (int i = 1; i < n; i++) {
+        element_t *e = slots[i];
+        int lo = 0, hi = i;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (element_before(e, slots[mid], descend))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        memmove(slots + lo + 1, slots + lo, (i - lo) * sizeof(element_t *));
+        slots[lo] = e;
+    }
+}
+
+void merge_add_run(struct list_head **pending,
+                   struct list_head *run,
+                   bool descend)
+{
+    int level = 0;
+    for (; pending[level]; level++) {
+        run = element_merge(pending[level], run, descend);
+        pending[level] = NULL;
+    }
+    pending[level] = run;
+}
+
+struct list_head *merge_pending(struct list_head **pending, bool descend)
+{
+    /* Higher levels hold earlier runs */
+    struct list_head *sorted = NULL;
+    for (int level = 0; level < MERGE_PENDING; level++) {
+        if (pending[level])
+            sorted = sorted ? element_merge(pending[level], sorted, descend)
+                            : pending[level];
+    }
+    return sorted;
+}
+
+void alarm_hold(sigset_t *saved)
+{
+    sigset_t alarm;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, saved);
+}
+
+void alarm_release(const sigset_t *saved)
+{
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
+void element_merge_into(struct list_head *a,
+                        struct list_head *b,
+                        bool descend)
+{
+    struct list_head *x = a->next, *y = b->next, *tail = a;
+    if (y == b)
+        return;
+
+    while (x != a && y != b) {
+        if (element_before(list_entry(y, element_t, list),
+                           list_entry(x, element_t, list), descend)) {
+            tail->next = y;
+            y->prev = tail;
+            tail = y;
+            y = y->next;
+        } else {
+            tail->next = x;
+            x->prev = tail;
+            tail = x;
+            x = x->next;
+        }
+    }
+    if (x != a) {
+        tail->next = x;
+        x->prev = tail;
+    } else {
+        tail->next = y;
+        y->prev = tail;
+        a->prev = b->prev;
+        a->prev->next = a;
+    }
+    INIT_LIST_HEAD(b);
+}
+
+/* Most queues merged in one pass, more take several passes */
+#define MERGE_WAYS 256
+
+/**
+ * struct merge_way - A list being merged by merge_ways()
+ * @node: next node to take from the list
+ * @last: last node of the list
+ * @order: position of the list in the chain, which decides ties
+ */
+struct merge_way {
+    struct list_head *node, *last;
+    int order;
+};
+
+static inline bool way_before(const struct merge_way *a,
+                              const struct merge_way *b,
+                              bool descend)
+{
+    int ret = element_cmp(list_entry(a->node, element_t, list),
+                          list_entry(b->node, element_t, list));
+    if (descend)
+        ret = -ret;
+    return ret < 0 || (!ret && a->order < b->order);
+}
+
+static void way_sift_down(struct merge_way *heap, int n, int i, bool descend)
+{
+    struct merge_way way = heap[i];
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n &&
+            way_before(&heap[child + 1], &heap[child], descend))
+            child++;
+        if (!way_before(&heap[child], &way, descend))
+            break;
+        heap[i] = heap[child];
+    }
+    heap[i] = way;
+}
+
+/* Merge the @n nonempty lists of @heap into @dst, always taking the next
+ * node of the list at the top of a min-heap, and link the nodes both ways as
+ * they are taken. The last list left is appended as it is.
+ */
+static void merge_ways(struct list_head *dst,
+                       struct merge_way *heap,
+                       int n,
+                       bool descend)
+{
+    struct list_head *tail = dst;
+    for (int i = n / 2 - 1; i >= 0; i--)
+        way_sift_down(heap, n, i, descend);
+
+    while (n > 1) {
+        struct list_head *node = heap[0].node;
+        tail->next = node;
+        node->prev = tail;
+        tail = node;
+        if (node == heap[0].last)
+            heap[0] = heap[--n];
+        else
+            heap[0].node = node->next;
+        way_sift_down(heap, n, 0, descend);
+    }
+    if (n) {
+        tail->next = heap[0].node;
+        heap[0].node->prev = tail;
+        tail = heap[0].last;
+    }
+    tail->next = dst;
+    dst->prev = tail;
+}
+
+/* Most threads a merge uses */
+#define MERGE_MAX_THREADS 64
+
+/**
+ * struct merge_task - Work of one thread of a parallel merge
+ * @a: list receiving the elements
+ * @b: list merged into @a, which precedes it in the chain
+ * @descend: order of the merge
+ * @stats: counters updated by the task
+ */
+struct merge_task {
+    struct list_head *a, *b;
+    bool descend;
+    q_stats_t stats;
+};
+
+static void *merge_task_run(void *arg)
+{
+    struct merge_task *task = arg;
+    q_stats_t saved = q_stats;
+
+    memset(&q_stats, 0, sizeof(q_stats));
+    element_merge_into(task->a, task->b, task->descend);
+    task->stats = q_stats;
+    q_stats = saved;
+    return NULL;
+}
+
+/* Run @n tasks at once, the first one on the calling thread, and add their
+ * counters to those of the calling thread.
+ */
+static void merge_tasks_run(struct merge_task *tasks, int n)
+{
+    pthread_t threads[MERGE_MAX_THREADS];
+    bool started[MERGE_MAX_THREADS] = {false};
+
+    for (int i = 1; i < n; i++)
+        started[i] = !pthread_create(&threads[i], NULL, merge_task_run,
+                                     &tasks[i]);
+    merge_task_run(&tasks[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            merge_task_run(&tasks[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        q_stats.cmps += tasks[i].stats.cmps;
+        q_stats.cmp_reads += tasks[i].stats.cmp_reads;
+    }
+}
+
+/* Merge the queues of the chain @head in log2(k) rounds, pairing each queue
+ * with the one @step places after it and running up to @nthreads of the
+ * merges of a round at once. Merging only neighbours, the earlier one first,
+ * gives the same result as merging them all together.
+ */
+static void merge_chain_parallel(struct list_head *head,
+                                 bool descend,
+                                 int nthreads,
+                                 void (*take)(struct list_head *q,
+                                              struct list_head *into))
+{
+    struct merge_task tasks[MERGE_MAX_THREADS];
+    sigset_t saved;
+    alarm_hold(&saved);
+
+    int k = 0;
+    for (struct list_head *pos = head->next; pos != head; pos = pos->next)
+        k++;
+
+    for (int step = 1; step < k; step *= 2) {
+        struct list_head *pos = head->next;
+        int n = 0;
+        while (pos != head) {
+            struct list_head *pair = pos;
+            for (int i = 0; i < step && pair != head; i++)
+                pair = pair->next;
+            if (pair == head)
+                break;
+
+            struct list_head *a = list_entry(pos, queue_contex_t, chain)->q;
+            struct list_head *b = list_entry(pair, queue_contex_t, chain)->q;
+            if (!list_empty(b)) {
+                tasks[n++] = (struct merge_task){a, b, descend, {0}};
+                take(b, a);
+            }
+            if (n == nthreads) {
+                merge_tasks_run(tasks, n);
+                n = 0;
+            }
+
+            pos = pair;
+            for (int i = 0; i < step && pos != head; i++)
+                pos = pos->next;
+        }
+        if (n)
+            merge_tasks_run(tasks, n);
+    }
+    alarm_release(&saved);
+}
+
+void element_merge_chain(struct list_head *head,
+                         bool descend,
+                         int nthreads,
+                         void (*take)(struct list_head *q,
+                                      struct list_head *into))
+{
+    if (nthreads > 1) {
+        merge_chain_parallel(head, descend,
+                             nthreads < MERGE_MAX_THREADS ? nthreads
+                                                          : MERGE_MAX_THREADS,
+                             take);
+        return;
+    }
+
+    struct list_head *dst = list_first_entry(head, queue_contex_t, chain)->q;
+    struct merge_way heap[MERGE_WAYS];
+    struct list_head *pos = head->next->next;
+    while (pos != head) {
+        int n = 0;
+        if (!list_empty(dst))
+            heap[n++] = (struct merge_way){dst->next, dst->prev, 0};
+        for (; pos != head && n < MERGE_WAYS; pos = pos->next) {
+            struct list_head *q = list_entry(pos, queue_contex_t, chain)->q;
+            if (list_empty(q))
+                continue;
+            heap[n] = (struct merge_way){q->next, q->prev, n};
+            n++;
+            INIT_LIST_HEAD(q);
+            take(q, dst);
+        }
+        if (n)
+            merge_ways(dst, heap, n, descend);
+    }
+}
+
+/* Make the null-terminated list @first the circular doubly linked list @head,
+ * restoring the prev links, which the merges ignore.
+ */
+static void list_relink(struct list_head *head, struct list_head *first)
+{
+    struct list_head *prev = head;
+    for (struct list_head *node = first; node; node = node->next) {
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+void element_list_sort(struct list_head *head, bool descend)
+{
+    if (list_empty(head) || list_is_singular(head))
+        return;
+
+    struct list_head *pending[MERGE_PENDING] = {NULL};
+    struct list_head *node = head->next;
+    head->prev->next = NULL;
+    while (node) {
+        struct list_head *next = node->next;
+        node->next = NULL;
+        merge_add_run(pending, node, descend);
+        node = next;
+    }
+    list_relink(head, merge_pending(pending, descend));
+}
+
+/* Runs shorter than this are extended by insertion before they are merged */
+#define NATURAL_MIN_RUN 16
+
+/* Elements taken in a row from one run before a merge starts galloping */
+#define NATURAL_MIN_GALLOP 7
+
+/**
+ * struct run - A sorted null-terminated list of elements
+ * @head: first node
+ * @tail: last node, so that runs already in order are joined in O(1)
+ * @len: number of nodes
+ */
+struct run {
+    struct list_head *head, *tail;
+    size_t len;
+};
+
+static inline element_t *node_element(struct list_head *node)
+{
+    return list_entry(node, element_t, list);
+}
+
+/* Whether @node goes before @key, or is merely not after it unless @strict */
+static inline bool run_before(struct list_head *node,
+                              element_t *key,
+                              bool strict,
+                              bool descend)
+{
+    element_t *e = node_element(node);
+    return strict ? element_before(e, key, descend)
+                  : !element_before(key, e, descend);
+}
+
+/* Return the last node of the longest prefix of the list starting at @node,
+ * which must itself qualify, that goes before @key. Probing at exponentially
+ * growing distances and then bisecting finds a prefix of k nodes with
+ * O(log k) comparisons, though still walking O(k) nodes.
+ */
+static struct list_head *gallop(struct list_head *node,
+                                element_t *key,
+                                bool strict,
+                                bool descend)
+{
+    size_t step = 1, dist;
+    for (;;) {
+        struct list_head *probe = node;
+        for (dist = 0; dist < step && probe->next; dist++)
+            probe = probe->next;
+        if (!dist)
+            return node;
+        if (!run_before(probe, key, strict, descend))
+            break;
+        node = probe;
+        if (dist < step)
+            return node;
+        step <<= 1;
+    }
+
+    /* @node qualifies, the node @dist after it does not */
+    while (dist > 1) {
+        size_t half = dist / 2;
+        struct list_head *mid = node;
+        for (size_t i = 0; i < half; i++)
+            mid = mid->next;
+        if (run_before(mid, key, strict, descend)) {
+            node = mid;
+            dist -= half;
+        } else {
+            dist = half;
+        }
+    }
+    return node;
+}
+
+/* Merge @b into @a, which precedes it, taking from @a on ties */
+static void run_merge(struct run *a, const struct run *b, bool descend)
+{
+    /* Runs that do not overlap, such as the pieces of a reversed list that
+     * equal strings cut into several strictly descending runs, are joined
+     * without walking them.
+     */
+    if (!element_before(node_element(b->head), node_element(a->tail),
+                        descend)) {
+        a->tail->next = b->head;
+        a->tail = b->tail;
+        a->len += b->len;
+        return;
+    }
+    if (element_before(node_element(b->tail), node_element(a->head),
+                       descend)) {
+        b->tail->next = a->head;
+        a->head = b->head;
+        a->len += b->len;
+        return;
+    }
+
+    struct list_head *x = a->head, *y = b->head;
+    struct list_head *head = NULL, **tail = &head;
+    int wins_x = 0, wins_y = 0;
+    while (x && y) {
+        struct list_head *last;
+        if (element_before(node_element(y), node_element(x), descend)) {
+            last = y;
+            if (++wins_y >= NATURAL_MIN_GALLOP) {
+                last = gallop(y, node_element(x), true, descend);
+                wins_y = 0;
+            }
+            wins_x = 0;
+            *tail = y;
+            y = last->next;
+        } else {
+            last = x;
+            if (++wins_x >= NATURAL_MIN_GALLOP) {
+                last = gallop(x, node_element(y), false, descend);
+                wins_x = 0;
+            }
+            wins_y = 0;
+            *tail = x;
+            x = last->next;
+        }
+        tail = &last->next;
+    }
+    if (x) {
+        *tail = x;
+    } else {
+        *tail = y;
+        a->tail = b->tail;
+    }
+    a->head = head;
+    a->len += b->len;
+}
+
+/* Cut the run at the start of the null-terminated @list into @run and return
+ * the rest of the list. A strictly descending run is reversed, which keeps
+ * the sort stable, and a short run is extended to NATURAL_MIN_RUN elements
+ * by insertion from its tail.
+ */
+static struct list_head *run_cut(struct run *run,
+                                 struct list_head *list,
+                                 bool descend)
+{
+    struct list_head *node = list->next;
+    run->len = 1;
+    if (node && element_before(node_element(node), node_element(list),
+                               descend)) {
+        run->head = run->tail = list;
+        list->next = NULL;
+        while (node && element_before(node_element(node),
+                                      node_element(run->head), descend)) {
+            struct list_head *next = node->next;
+            node->next = run->head;
+            run->head = node;
+            node = next;
+            run->len++;
+        }
+    } else {
+        run->head = run->tail = list;
+        while (node && !element_before(node_element(node),
+                                       node_element(run->tail), descend)) {
+            run->tail = node;
+            node = node->next;
+            run->len++;
+        }
+        run->tail->next = NULL;
+    }
+
+    if (run->len >= NATURAL_MIN_RUN || !node)
+        return node;
+
+    struct list_head *prev = NULL;
+    for (struct list_head *p = run->head; p; p = p->next) {
+        p->prev = prev;
+        prev = p;
+    }
+    while (node && run->len < NATURAL_MIN_RUN) {
+        struct list_head *next = node->next, *p = run->tail;
+        while (p && element_before(node_element(node), node_element(p),
+                                   descend))
+            p = p->prev;
+        node->prev = p;
+        if (p) {
+            node->next = p->next;
+            p->next = node;
+        } else {
+            node->next = run->head;
+            run->head = node;
+        }
+        if (node->next)
+            node->next->prev = node;
+        else
+            run->tail = node;
+        node = next;
+        run->len++;
+    }
+    return node;
+}
+
+/* Merge runs[k + 1] into runs[k] */
+static void run_merge_at(struct run *runs, int *n, int k, bool descend)
+{
+    run_merge(&runs[k], &runs[k + 1], descend);
+    if (k + 2 < *n)
+        runs[k + 1] = runs[k + 2];
+    (*n)--;
+}
+
+void element_list_natural_sort(struct list_head *head, bool descend)
+{
+    if (list_empty(head) || list_is_singular(head))
+        return;
+
+    struct run runs[MERGE_PENDING];
+    int n = 0;
+    struct list_head *list = head->next;
+    head->prev->next = NULL;
+    while (list) {
+        list = run_cut(&runs[n++], list, descend);
+
+        /* Keep the lengths of the pending runs growing at least like the
+         * Fibonacci numbers from the top of the stack down, which bounds
+         * its depth and keeps merges balanced.
+         */
+        while (n > 1) {
+            int k = n - 2;
+            if ((k > 0 && runs[k - 1].len <= runs[k].len + runs[k + 1].len) ||
+                (k > 1 && runs[k - 2].len <= runs[k - 1].len + runs[k].len)) {
+                if (runs[k - 1].len < runs[k + 1].len)
+                    k--;
+            } else if (runs[k].len > runs[k + 1].len) {
+                break;
+            }
+            run_merge_at(runs, &n, k, descend);
+        }
+    }
+    while (n > 1) {
+        int k = n - 2;
+        if (k > 0 && runs[k - 1].len < runs[k + 1].len)
+            k--;
+        run_merge_at(runs, &n, k, descend);
+    }
+    list_relink(head, runs[0].head);
+}
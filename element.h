@@ -0,0 +1,449 @@
+#ifndef LAB0_ELEMENT_H
+#define LAB0_ELEMENT_H
+
+/* Element storage shared by the queue implementations: the per-queue slab
+ * allocator, the string interning pool and the string comparisons.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "queue.h"
+
+/* Create an allocator for the elements of one queue */
+struct slab *slab_new();
+
+/* Make room for @n more elements in a single chunk, unless they are already
+ * available.
+ */
+bool slab_reserve(struct slab *slab, size_t n);
+
+/* Return the slab a batch of @n elements is allocated from: @slab, the one of
+ * the queue, with room reserved for them, or else a slab holding just the
+ * batch, in a single chunk, that goes away with the last of its elements once
+ * slab_batch_end() has been called. Return NULL if out of memory, in which case
+ * the elements come from malloc.
+ */
+struct slab *slab_batch_begin(struct slab *slab, size_t n);
+
+/* Finish allocating from @batch, returned by slab_batch_begin() for @slab */
+void slab_batch_end(struct slab *slab, struct slab *batch);
+
+/* Give up the ownership of @slab when its queue is freed. It goes away as soon
+ * as no element taken from it is alive anymore.
+ */
+void slab_orphan(struct slab *slab);
+
+/* Allocate an element holding a copy of the string @s of @len bytes, including
+ * the null terminator, from @slab, or from malloc if it is NULL. Short strings
+ * are kept inline so that only long ones cost a second allocation, or none at
+ * all if they are interned.
+ */
+element_t *element_new(struct slab *slab, const char *s, size_t len);
+
+/* Release the string of @e unless it is stored inline */
+void element_free_value(element_t *e);
+
+/* Release @e while freeing the queue owning @slab. Elements of @slab itself
+ * go away together with its chunks.
+ */
+void element_discard(element_t *e, struct slab *slab);
+
+/* Load the first bytes of @s, zero padded, so that comparing two prefixes as
+ * integers orders them like memcmp() orders the bytes.
+ */
+static inline uint64_t string_prefix(const char *s, size_t len)
+{
+    uint64_t prefix = 0;
+    memcpy(&prefix, s, len < sizeof(prefix) ? len : sizeof(prefix));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+}
+
+/* Return the offset of the first of the @n bytes at which @a and @b differ, or
+ * @n if there is none. The lengths are known, so no terminator is looked for,
+ * and no byte past @n is read: the last vector step loads the final bytes
+ * again instead of crossing over into what may be an unmapped page.
+ *
+ * Only used when q_cmp_simd is set. memcmp() of glibc already dispatches to a
+ * vector loop for the processor at hand and aligns its loads, so inlining this
+ * one saves no more than a call, and loses on long strings.
+ */
+static inline size_t bytes_mismatch(const char *a, const char *b, size_t n)
+{
+#if defined(__AVX2__)
+#define VEC_SIZE 32
+#define VEC_FULL 0xffffffffU
+#define vec_eq(x, y)                                          \
+    _mm256_cmpeq_epi8(_mm256_loadu_si256((const void *) (x)), \
+                      _mm256_loadu_si256((const void *) (y)))
+#define vec_and _mm256_and_si256
+#define vec_mask(v) ((uint32_t) _mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#define VEC_SIZE 16
+#define VEC_FULL 0xffffU
+#define vec_eq(x, y)                                    \
+    _mm_cmpeq_epi8(_mm_loadu_si128((const void *) (x)), \
+                   _mm_loadu_si128((const void *) (y)))
+#define vec_and _mm_and_si128
+#define vec_mask(v) ((uint32_t) _mm_movemask_epi8(v))
+#endif
+    size_t i = 0;
+#ifdef VEC_SIZE
+    if (n >= VEC_SIZE) {
+        /* Four vectors per step while they are equal, one by one then */
+        for (; i + 4 * VEC_SIZE <= n; i += 4 * VEC_SIZE) {
+            if (vec_mask(vec_and(
+                    vec_and(vec_eq(a + i, b + i),
+                            vec_eq(a + i + VEC_SIZE, b + i + VEC_SIZE)),
+                    vec_and(vec_eq(a + i + 2 * VEC_SIZE, b + i + 2 * VEC_SIZE),
+                            vec_eq(a + i + 3 * VEC_SIZE,
+                                   b + i + 3 * VEC_SIZE)))) != VEC_FULL)
+                break;
+        }
+        uint32_t ne;
+        for (; i + VEC_SIZE <= n; i += VEC_SIZE) {
+            if ((ne = vec_mask(vec_eq(a + i, b + i)) ^ VEC_FULL))
+                return i + __builtin_ctz(ne);
+        }
+        if (i == n)
+            return n;
+        /* Load the last bytes again, rather than past them */
+        i = n - VEC_SIZE;
+        ne = vec_mask(vec_eq(a + i, b + i)) ^ VEC_FULL;
+        return ne ? i + __builtin_ctz(ne) : n;
+    }
+#undef VEC_SIZE
+#undef VEC_FULL
+#undef vec_eq
+#undef vec_and
+#undef vec_mask
+#endif
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + __builtin_ctzll(x ^ y) / 8;
+#else
+            return i + __builtin_clzll(x ^ y) / 8;
+#endif
+        }
+    }
+    for (; i < n && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+/* Compare the strings of two elements like strcmp() does, without scanning
+ * for their terminators. Strings hold no null characters, so when the prefixes
+ * are equal and one string is no longer than a prefix, only the lengths can
+ * still differ.
+ */
+static inline int element_cmp(const element_t *a, const element_t *b)
+{
+    q_stats.cmps++;
+    if (a->value == b->value)
+        return 0;
+
+    size_t skip = 0;
+    if (q_cmp_prefix) {
+        if (a->prefix != b->prefix)
+            return a->prefix < b->prefix ? -1 : 1;
+        if (a->len <= sizeof(a->prefix) || b->len <= sizeof(b->prefix))
+            return (a->len > b->len) - (a->len < b->len);
+        skip = sizeof(a->prefix);
+    }
+
+    q_stats.cmp_reads++;
+    size_t len = a->len < b->len ? a->len : b->len;
+    if (q_cmp_simd) {
+        size_t i = skip + bytes_mismatch(a->value + skip, b->value + skip,
+                                         len - skip);
+        if (i < len)
+            return (unsigned char) a->value[i] - (unsigned char) b->value[i];
+    } else {
+        int ret = memcmp(a->value + skip, b->value + skip, len - skip);
+        if (ret)
+            return ret;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+/* Hash the string of @e a word at a time. The first word is the cached prefix,
+ * so strings no longer than it are hashed without being read.
+ */
+static inline uint64_t element_hash(const element_t *e)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = (e->len ^ e->prefix) * k;
+    for (size_t i = sizeof(e->prefix); i < e->len; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        size_t n = e->len - i < sizeof(word) ? e->len - i : sizeof(word);
+        memcpy(&word, e->value + i, n);
+        hash = (hash ^ (hash >> 29) ^ word) * k;
+    }
+    hash ^= hash >> 32;
+    hash *= 0xd6e8feb86659fd93ULL;
+    return hash ^ (hash >> 32);
+}
+
+static inline bool element_equal(const element_t *a, const element_t *b)
+{
+    q_stats.cmps++;
+    /* Interned strings are equal exactly if they are the same copy */
+    if (a->interned && b->interned)
+        return a->value == b->value;
+    if (a->len != b->len)
+        return false;
+
+    size_t skip = 0;
+    if (q_cmp_prefix) {
+        if (a->prefix != b->prefix)
+            return false;
+        if (a->len <= sizeof(a->prefix))
+            return true;
+        skip = sizeof(a->prefix);
+    }
+
+    q_stats.cmp_reads++;
+    if (q_cmp_simd)
+        return bytes_mismatch(a->value + skip, b->value + skip,
+                              a->len - skip) == a->len - skip;
+    return !memcmp(a->value + skip, b->value + skip, a->len - skip);
+}
+
+/* Copy at most bufsize - 1 bytes of the string of @e to @sp and terminate it */
+static inline void element_copy(char *sp, const element_t *e, size_t bufsize)
+{
+    if (!sp || !bufsize)
+        return;
+    size_t len = e->len < bufsize - 1 ? e->len : bufsize - 1;
+    memcpy(sp, e->value, len);
+    sp[len] = '\0';
+}
+
+/* Whether @a has to come before @b in a stable sort */
+static inline bool element_before(const element_t *a,
+                                  const element_t *b,
+                                  bool descend)
+{
+    int ret = element_cmp(a, b);
+    return descend ? ret > 0 : ret < 0;
+}
+
+/* How many elements ahead the walks over arrays of elements prefetch, the
+ * strings being prefetched half as far ahead
+ */
+#define PREFETCH_DISTANCE 8
+
+/* Start loading the fields of the element of @node, if any, that a walk
+ * comparing it reaches first. Prefetches never fault, so @node may as well be
+ * a list head.
+ */
+static inline void element_prefetch(const struct list_head *node)
+{
+    if (q_prefetch && node)
+        __builtin_prefetch(&list_entry(node, element_t, list)->prefix);
+}
+
+/* Start loading all of @e, ahead of a walk releasing it */
+static inline void element_prefetch_whole(const element_t *e)
+{
+    if (q_prefetch) {
+        __builtin_prefetch(e);
+        __builtin_prefetch((const char *) e + sizeof(*e) - 1);
+    }
+}
+
+/* Start loading the string of @e, unless it is stored inline */
+static inline void element_prefetch_value(const element_t *e)
+{
+    if (q_prefetch && e->value != e->data)
+        __builtin_prefetch(e->value);
+}
+
+/* Start loading what a merge compares once it takes the element of @taken
+ * while the element of @waiting heads the other list: the string of the
+ * element after @taken, in case the prefixes tie, and the element after
+ * @waiting. The element after @taken is compared next anyway, whereas going
+ * one further along its list would wait for it to load first.
+ */
+static inline void element_prefetch_merge(const struct list_head *taken,
+                                          const struct list_head *waiting)
+{
+    if (q_prefetch) {
+        if (taken->next)
+            element_prefetch_value(list_entry(taken->next, element_t, list));
+        element_prefetch(waiting->next);
+    }
+}
+
+/* Start loading what a walk releasing the elements of the list @head reaches
+ * after the element before @next: the string of @next and the element after
+ * it. @next itself has been prefetched one step earlier, so that the walk
+ * keeps two elements in flight while it releases the current one.
+ */
+static inline void element_prefetch_walk(const struct list_head *next,
+                                         const struct list_head *head)
+{
+    if (q_prefetch && next != head) {
+        element_prefetch_whole(list_entry(next->next, element_t, list));
+        element_prefetch_value(list_entry(next, element_t, list));
+    }
+}
+
+/* Turn any @seed, zero included, into a state for rng_next() by mixing it
+ * with the splitmix64 finalizer.
+ */
+static inline uint64_t rng_seed(uint64_t seed)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+/* Advance the xorshift64* generator of nonzero @state */
+static inline uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Draw uniformly from [0, @bound) by scaling instead of taking a modulo,
+ * rejecting the few draws that would make some results likelier (Lemire).
+ */
+static inline uint32_t rng_below(uint64_t *state, uint32_t bound)
+{
+    uint64_t m = (rng_next(state) >> 32) * bound;
+    if ((uint32_t) m < bound) {
+        uint32_t threshold = -bound % bound;
+        while ((uint32_t) m < threshold)
+            m = (rng_next(state) >> 32) * bound;
+    }
+    return m >> 32;
+}
+
+/* Shuffle the @n elements at @slots with Fisher-Yates */
+void element_shuffle_slots(element_t **slots, int n, uint64_t *state);
+
+/* Shuffle the list of @n elements @head through an array of them, return
+ * false if out of memory.
+ */
+bool element_list_shuffle(struct list_head *head, int n, uint64_t seed);
+
+/**
+ * struct dup_slot - Slot of a dup_set
+ * @e: first element added holding the string, NULL for an empty slot
+ * @hash: upper half of the hash of the string, to skip most comparisons
+ * @count: number of elements holding the string added so far
+ */
+struct dup_slot {
+    element_t *e;
+    uint32_t hash;
+    uint32_t count;
+};
+
+/* Open addressing hash set counting the copies of each string */
+struct dup_set {
+    struct dup_slot *slots;
+    size_t mask;
+};
+
+/* Prepare @set for up to @n elements, return false if out of memory */
+bool dup_set_init(struct dup_set *set, int n);
+
+void dup_set_exit(struct dup_set *set);
+
+/* Return the slot of the string of @e, adding it first if it is missing */
+struct dup_slot *dup_set_find(struct dup_set *set, element_t *e);
+
+/* Count one more copy of the string of @e and return its slot */
+static inline struct dup_slot *dup_set_add(struct dup_set *set, element_t *e)
+{
+    struct dup_slot *slot = dup_set_find(set, e);
+    slot->count++;
+    return slot;
+}
+
+/* Merge two null-terminated sorted lists of elements, taking from @a on ties */
+struct list_head *element_merge(struct list_head *a,
+                                struct list_head *b,
+                                bool descend);
+
+/* Sort the @n elements at @slots with binary insertion sort, which is stable
+ * and needs no memory.
+ */
+void element_sort_slots(element_t **slots, int n, bool descend);
+
+/* Number of pending runs of a bottom-up merge sort, enough for any list */
+#define MERGE_PENDING 64
+
+/* Add the null-terminated sorted @run, which follows every run added before,
+ * to @pending. pending[i] holds the merge of 2^i runs, so that runs of equal
+ * length are merged like the bits of a binary counter.
+ */
+void merge_add_run(struct list_head **pending,
+                   struct list_head *run,
+                   bool descend);
+
+/* Merge the runs left in @pending into a single sorted list */
+struct list_head *merge_pending(struct list_head **pending, bool descend);
+
+/* Merge the sorted list @b into the sorted list @a, which precedes it, taking
+ * from @a on ties, and leave @b empty.
+ */
+void element_merge_into(struct list_head *a,
+                        struct list_head *b,
+                        bool descend);
+
+/* The time limit of the harness fires SIGALRM, whose handler jumps out of the
+ * operation. Hold it back while the queues are in pieces, so that it reaches
+ * the calling thread after the other threads are done.
+ */
+void alarm_hold(sigset_t *saved);
+void alarm_release(const sigset_t *saved);
+
+/* Merge the sorted queues of the chain @head into the first one, taking from
+ * the earlier queue on ties. With @nthreads up to 1, this is a k-way merge
+ * over a heap, otherwise neighbouring queues are merged pairwise in log2(k)
+ * rounds, running up to @nthreads merges of a round at once. Whenever the
+ * elements of the queue @q go to the queue @into, @q is handed to @take, so
+ * that the backend can move whatever else it keeps for @q over to @into.
+ * @take must not touch the lists themselves, which may still be merging.
+ */
+void element_merge_chain(struct list_head *head,
+                         bool descend,
+                         int nthreads,
+                         void (*take)(struct list_head *q,
+                                      struct list_head *into));
+
+/* Sort the list of elements @head with a stable bottom-up merge sort, feeding
+ * the elements to merge_add_run() one at a time in a single pass.
+ */
+void element_list_sort(struct list_head *head, bool descend);
+
+/* Sort the list of elements @head with a stable natural merge sort that
+ * merges the ascending and strictly descending runs already in the list,
+ * galloping through long stretches taken from one run. Sorted and reversed
+ * lists take O(n) time.
+ */
+void element_list_natural_sort(struct list_head *head, bool descend);
+
+#endif /* LAB0_ELEMENT_H */
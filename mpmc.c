@@ -0,0 +1,325 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The producers and consumers allocate and free concurrently, which the
+ * allocator of the test harness does not support.
+ */
+#define INTERNAL 1
+#include "element.h"
+#include "mpmc.h"
+
+/* The ends of the queue live on cache lines of their own */
+#define MPMC_ALIGN 64
+
+/* Hazard pointers of each thread: the head, or the tail, and the node after */
+#define MPMC_HAZARDS 2
+
+/* Nodes a thread takes off on top of twice the hazard pointers of all threads
+ * before it frees those no longer in use, so that each scan of the hazard
+ * pointers frees at least about as many nodes as there are hazard pointers.
+ */
+#define MPMC_RETIRE_MIN 64
+
+/**
+ * struct mpmc_node - Node of the list
+ * @next: node after this one, NULL for the last one
+ * @e: element stored in the node, taken by the thread that removes it, after
+ *     which the node stays on as the dummy of the head
+ * @retired: next node taken off by the same thread and waiting to be freed
+ */
+struct mpmc_node {
+    _Atomic(struct mpmc_node *) next;
+    element_t *e;
+    struct mpmc_node *retired;
+};
+
+/**
+ * struct mpmc_thread - Handle of a thread using a queue
+ * @hazard: nodes the thread may read, which no thread may free meanwhile
+ * @q: queue the handle belongs to
+ * @next: next handle of the queue, set once before the handle is published
+ * @active: whether a thread holds the handle
+ * @retired: nodes the thread took off, waiting to be freed
+ * @nr_retired: number of nodes in @retired
+ */
+struct mpmc_thread {
+    _Atomic(struct mpmc_node *) hazard[MPMC_HAZARDS];
+    struct mpmc *q;
+    struct mpmc_thread *next;
+    atomic_bool active;
+    struct mpmc_node *retired;
+    size_t nr_retired;
+};
+
+/**
+ * struct mpmc - Concurrent queue
+ * @threads: every handle ever created for the queue, most recent first
+ * @nr_threads: number of handles in @threads
+ * @head: dummy node, before the first element
+ * @tail: last node, or the one before it while an insertion catches up
+ */
+struct mpmc {
+    _Atomic(struct mpmc_thread *) threads;
+    atomic_size_t nr_threads;
+    _Alignas(MPMC_ALIGN) _Atomic(struct mpmc_node *) head;
+    _Alignas(MPMC_ALIGN) _Atomic(struct mpmc_node *) tail;
+};
+
+static struct mpmc_node *node_new(element_t *e)
+{
+    struct mpmc_node *node = malloc(sizeof(*node));
+    if (!node)
+        return NULL;
+    atomic_init(&node->next, NULL);
+    node->e = e;
+    node->retired = NULL;
+    return node;
+}
+
+struct mpmc *mpmc_new(void)
+{
+    struct mpmc *q = aligned_alloc(MPMC_ALIGN, sizeof(*q));
+    if (!q)
+        return NULL;
+    struct mpmc_node *dummy = node_new(NULL);
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->threads, NULL);
+    atomic_init(&q->nr_threads, 0);
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    return q;
+}
+
+void mpmc_free(struct mpmc *q)
+{
+    if (!q)
+        return;
+
+    /* The element of the dummy was handed out when it was removed */
+    struct mpmc_node *dummy = atomic_load(&q->head), *node, *next;
+    for (node = atomic_load(&dummy->next); node; node = next) {
+        next = atomic_load(&node->next);
+        mpmc_release_element(node->e);
+        free(node);
+    }
+    free(dummy);
+
+    struct mpmc_thread *t = atomic_load(&q->threads);
+    for (struct mpmc_thread *next; t; t = next) {
+        next = t->next;
+        for (struct mpmc_node *r = t->retired, *safe; r; r = safe) {
+            safe = r->retired;
+            free(r);
+        }
+        free(t);
+    }
+    free(q);
+}
+
+struct mpmc_thread *mpmc_join(struct mpmc *q)
+{
+    if (!q)
+        return NULL;
+
+    for (struct mpmc_thread *t = atomic_load(&q->threads); t; t = t->next) {
+        bool idle = false;
+        if (atomic_compare_exchange_strong(&t->active, &idle, true))
+            return t;
+    }
+
+    struct mpmc_thread *t = malloc(sizeof(*t));
+    if (!t)
+        return NULL;
+    for (int i = 0; i < MPMC_HAZARDS; i++)
+        atomic_init(&t->hazard[i], NULL);
+    t->q = q;
+    atomic_init(&t->active, true);
+    t->retired = NULL;
+    t->nr_retired = 0;
+    t->next = atomic_load(&q->threads);
+    while (!atomic_compare_exchange_weak(&q->threads, &t->next, t))
+        ;
+    atomic_fetch_add(&q->nr_threads, 1);
+    return t;
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Free the nodes taken off by @t that no hazard pointer points to. Handles
+ * added after the list of handles is loaded are missed, but they were added
+ * after the nodes were taken off, so their threads cannot have reached them.
+ */
+static void mpmc_scan(struct mpmc_thread *t)
+{
+    struct mpmc_thread *first = atomic_load(&t->q->threads), *h;
+    size_t max = 0, n = 0;
+    for (h = first; h; h = h->next)
+        max += MPMC_HAZARDS;
+    uintptr_t *hazards = malloc(max * sizeof(*hazards));
+    if (!hazards)
+        return;
+
+    for (h = first; h; h = h->next) {
+        for (int i = 0; i < MPMC_HAZARDS; i++) {
+            struct mpmc_node *node = atomic_load(&h->hazard[i]);
+            if (node)
+                hazards[n++] = (uintptr_t) node;
+        }
+    }
+    qsort(hazards, n, sizeof(*hazards), ptr_cmp);
+
+    struct mpmc_node **link = &t->retired;
+    while (*link) {
+        struct mpmc_node *node = *link;
+        uintptr_t key = (uintptr_t) node;
+        if (n && bsearch(&key, hazards, n, sizeof(*hazards), ptr_cmp)) {
+            link = &node->retired;
+        } else {
+            *link = node->retired;
+            free(node);
+            t->nr_retired--;
+        }
+    }
+    free(hazards);
+}
+
+/* Queue @node, just taken off the head by @t, to be freed */
+static void mpmc_retire(struct mpmc_thread *t, struct mpmc_node *node)
+{
+    node->retired = t->retired;
+    t->retired = node;
+    if (++t->nr_retired >=
+        MPMC_RETIRE_MIN + 2 * MPMC_HAZARDS * atomic_load(&t->q->nr_threads))
+        mpmc_scan(t);
+}
+
+void mpmc_leave(struct mpmc_thread *t)
+{
+    if (!t)
+        return;
+    for (int i = 0; i < MPMC_HAZARDS; i++)
+        atomic_store(&t->hazard[i], NULL);
+    /* What is still in use waits for the next thread using the handle */
+    if (t->nr_retired)
+        mpmc_scan(t);
+    atomic_store(&t->active, false);
+}
+
+/* Allocate an element and its string in a single block */
+static element_t *element_alloc(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    if (len > UINT32_MAX)
+        return NULL;
+
+    size_t extra = len > sizeof(((element_t *) 0)->data) ? len : 0;
+    element_t *e = malloc(sizeof(*e) + extra);
+    if (!e)
+        return NULL;
+    e->value = extra ? (char *) (e + 1) : e->data;
+    memcpy(e->value, s, len);
+    e->len = len - 1;
+    e->prefix = string_prefix(s, len - 1);
+    e->slab = NULL;
+    e->interned = false;
+    return e;
+}
+
+void mpmc_release_element(element_t *e)
+{
+    free(e);
+}
+
+bool mpmc_insert_tail(struct mpmc_thread *t, const char *s)
+{
+    if (!t || !s)
+        return false;
+
+    element_t *e = element_alloc(s);
+    if (!e)
+        return false;
+    struct mpmc_node *node = node_new(e);
+    if (!node) {
+        mpmc_release_element(e);
+        return false;
+    }
+
+    struct mpmc *q = t->q;
+    struct mpmc_node *tail;
+    for (;;) {
+        /* The tail may be taken off and freed until it is seen again once
+         * announced
+         */
+        tail = atomic_load(&q->tail);
+        atomic_store(&t->hazard[0], tail);
+        if (tail != atomic_load(&q->tail))
+            continue;
+
+        struct mpmc_node *next = atomic_load(&tail->next);
+        if (next) {
+            /* Another insertion is yet to move the tail to its node */
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_weak(&tail->next, &next, node))
+            break;
+    }
+
+    /* Failing means another thread has moved the tail on already */
+    atomic_compare_exchange_strong(&q->tail, &tail, node);
+    atomic_store(&t->hazard[0], NULL);
+    return true;
+}
+
+element_t *mpmc_remove_head(struct mpmc_thread *t, char *sp, size_t bufsize)
+{
+    if (!t)
+        return NULL;
+
+    struct mpmc *q = t->q;
+    struct mpmc_node *head;
+    element_t *e;
+    for (;;) {
+        head = atomic_load(&q->head);
+        atomic_store(&t->hazard[0], head);
+        if (head != atomic_load(&q->head))
+            continue;
+
+        struct mpmc_node *tail = atomic_load(&q->tail);
+        struct mpmc_node *next = atomic_load(&head->next);
+        atomic_store(&t->hazard[1], next);
+        /* As long as the head has not moved, its next node is still linked */
+        if (head != atomic_load(&q->head))
+            continue;
+
+        if (!next) {
+            e = NULL;
+            break;
+        }
+        if (head == tail) {
+            /* Never let the head get past the tail */
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+        e = next->e;
+        if (atomic_compare_exchange_weak(&q->head, &head, next))
+            break;
+    }
+    atomic_store(&t->hazard[0], NULL);
+    atomic_store(&t->hazard[1], NULL);
+
+    if (!e)
+        return NULL;
+    mpmc_retire(t, head);
+    element_copy(sp, e, bufsize);
+    return e;
+}
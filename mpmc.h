@@ -0,0 +1,65 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/* Concurrent queue of strings, on which any number of threads may insert at
+ * the tail and remove from the head at the same time without taking a lock.
+ *
+ * It is the linked list of Michael and Scott: the head always points to a
+ * dummy node, the node whose element was removed last, and the tail to the
+ * last node or, for a moment, to the one before it. A producer links its node
+ * after the last one with a compare and swap and then swings the tail to it,
+ * which any other thread finding the tail lagging behind does on its behalf.
+ * A consumer swings the head to the node after the dummy, whose element it
+ * takes, and that node becomes the new dummy. No thread ever waits for
+ * another one to finish its step, and the queue grows as long as memory lasts.
+ *
+ * A node taken off the head may still be read by threads that loaded the head
+ * before it moved. Each thread therefore announces the nodes it is about to
+ * read in hazard pointers, and the nodes it takes off are freed only once no
+ * hazard pointer of any thread points to them, by batches.
+ *
+ * Every thread using a queue joins it first, to get the hazard pointers it
+ * works with, and leaves it when done.
+ *
+ * Unlike the queues of queue.h, elements are allocated with the allocator of
+ * the C library, which unlike the one of the test harness is thread safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+struct mpmc;
+struct mpmc_thread;
+
+/* Create an empty queue. Return NULL if out of memory. */
+struct mpmc *mpmc_new(void);
+
+/* Free @q and the elements left in it. No other thread may be using it, and
+ * the handles of the threads that joined it can no longer be used.
+ */
+void mpmc_free(struct mpmc *q);
+
+/* Get a handle for the calling thread to use @q with, reusing the one of a
+ * thread that left it if any. Return NULL if out of memory.
+ */
+struct mpmc_thread *mpmc_join(struct mpmc *q);
+
+/* Give up the handle @t, which another thread may then reuse */
+void mpmc_leave(struct mpmc_thread *t);
+
+/* Insert a copy of the string @s at the tail of the queue of @t, like
+ * q_insert_tail(). Return false if out of memory.
+ */
+bool mpmc_insert_tail(struct mpmc_thread *t, const char *s);
+
+/* Remove the element at the head of the queue of @t and copy its string to
+ * @sp, like q_remove_head(). Return NULL if the queue is empty.
+ */
+element_t *mpmc_remove_head(struct mpmc_thread *t, char *sp, size_t bufsize);
+
+/* Release an element removed from a concurrent queue */
+void mpmc_release_element(element_t *e);
+
+#endif /* LAB0_MPMC_H */
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "qindex.h"
+
+/* Slots of a leaf, and children of an inner node */
+#define QINDEX_FANOUT 64
+
+/* Slots filled when building, leaving room for insertions */
+#define QINDEX_FILL (QINDEX_FANOUT * 3 / 4)
+
+/**
+ * struct qindex_node - Node of a counted B-tree
+ * @n: number of slots, or children, in use
+ * @height: 0 for a leaf, one more than its children for an inner node
+ * @slots: elements of a leaf, in queue order
+ * @child: children of an inner node, in queue order
+ * @count: number of elements under each child
+ */
+struct qindex_node {
+    int n;
+    int height;
+    union {
+        element_t *slots[QINDEX_FANOUT];
+        struct {
+            struct qindex_node *child[QINDEX_FANOUT];
+            int count[QINDEX_FANOUT];
+        };
+    };
+};
+
+struct qindex {
+    struct qindex_node *root;
+};
+
+static struct qindex_node *node_new(int height)
+{
+    struct qindex_node *node = malloc(sizeof(*node));
+    if (!node)
+        return NULL;
+    node->n = 0;
+    node->height = height;
+    return node;
+}
+
+static void node_free(struct qindex_node *node)
+{
+    if (node->height) {
+        for (int c = 0; c < node->n; c++)
+            node_free(node->child[c]);
+    }
+    free(node);
+}
+
+/* Number of elements under @node */
+static int node_count(const struct qindex_node *node)
+{
+    if (!node->height)
+        return node->n;
+    int count = 0;
+    for (int c = 0; c < node->n; c++)
+        count += node->count[c];
+    return count;
+}
+
+/* Gather the nodes of @level, @n of them, under new parents, which replace
+ * them at the start of @level. Return the number of parents, or -1 if out of
+ * memory, in which case every node is freed.
+ */
+static int build_level(struct qindex_node **level, int n)
+{
+    int parents = 0;
+    for (int i = 0; i < n; i += QINDEX_FILL) {
+        struct qindex_node *parent = node_new(level[i]->height + 1);
+        if (!parent) {
+            for (int j = 0; j < parents; j++)
+                node_free(level[j]);
+            for (int j = i; j < n; j++)
+                node_free(level[j]);
+            return -1;
+        }
+        for (int j = i; j < n && j < i + QINDEX_FILL; j++) {
+            parent->child[parent->n] = level[j];
+            parent->count[parent->n++] = node_count(level[j]);
+        }
+        level[parents++] = parent;
+    }
+    return parents;
+}
+
+struct qindex *qindex_new(struct list_head *head, int n)
+{
+    struct qindex *idx = malloc(sizeof(*idx));
+    int leaves = n ? (n + QINDEX_FILL - 1) / QINDEX_FILL : 1;
+    struct qindex_node **level = malloc(leaves * sizeof(*level));
+    if (!idx || !level) {
+        free(idx);
+        free(level);
+        return NULL;
+    }
+
+    struct list_head *node = head->next;
+    for (int i = 0; i < leaves; i++) {
+        level[i] = node_new(0);
+        if (!level[i]) {
+            while (i--)
+                node_free(level[i]);
+            free(level);
+            free(idx);
+            return NULL;
+        }
+        for (; level[i]->n < QINDEX_FILL && node != head; node = node->next)
+            level[i]->slots[level[i]->n++] = list_entry(node, element_t, list);
+    }
+
+    while (leaves > 1) {
+        leaves = build_level(level, leaves);
+        if (leaves < 0) {
+            free(level);
+            free(idx);
+            return NULL;
+        }
+    }
+    idx->root = level[0];
+    free(level);
+    return idx;
+}
+
+void qindex_free(struct qindex *idx)
+{
+    if (!idx)
+        return;
+    node_free(idx->root);
+    free(idx);
+}
+
+element_t *qindex_at(const struct qindex *idx, int i)
+{
+    const struct qindex_node *node = idx->root;
+    while (node->height) {
+        int c = 0;
+        while (i >= node->count[c])
+            i -= node->count[c++];
+        node = node->child[c];
+    }
+    return node->slots[i];
+}
+
+/* Move the upper half of the full child @c of @parent, which is not full, to
+ * a new node following it.
+ */
+static bool split_child(struct qindex_node *parent, int c)
+{
+    struct qindex_node *left = parent->child[c];
+    struct qindex_node *right = node_new(left->height);
+    if (!right)
+        return false;
+
+    int half = left->n / 2;
+    right->n = left->n - half;
+    left->n = half;
+    if (left->height) {
+        memcpy(right->child, left->child + half,
+               right->n * sizeof(*right->child));
+        memcpy(right->count, left->count + half,
+               right->n * sizeof(*right->count));
+    } else {
+        memcpy(right->slots, left->slots + half,
+               right->n * sizeof(*right->slots));
+    }
+
+    memmove(parent->child + c + 2, parent->child + c + 1,
+            (parent->n - c - 1) * sizeof(*parent->child));
+    memmove(parent->count + c + 2, parent->count + c + 1,
+            (parent->n - c - 1) * sizeof(*parent->count));
+    parent->child[c + 1] = right;
+    parent->count[c + 1] = node_count(right);
+    parent->count[c] -= parent->count[c + 1];
+    parent->n++;
+    return true;
+}
+
+/* Split the full nodes on the way down, so that there is room for a new
+ * child in the parent of whichever node has to be split.
+ */
+bool qindex_insert(struct qindex *idx, int i, element_t *e)
+{
+    struct qindex_node *node = idx->root;
+    if (node->n == QINDEX_FANOUT) {
+        struct qindex_node *root = node_new(node->height + 1);
+        if (!root)
+            return false;
+        root->child[0] = node;
+        root->count[0] = node_count(node);
+        root->n = 1;
+        if (!split_child(root, 0)) {
+            free(root);
+            return false;
+        }
+        idx->root = node = root;
+    }
+
+    while (node->height) {
+        int c = 0;
+        while (c < node->n - 1 && i > node->count[c])
+            i -= node->count[c++];
+        if (node->child[c]->n == QINDEX_FANOUT) {
+            if (!split_child(node, c))
+                return false;
+            if (i > node->count[c])
+                i -= node->count[c++];
+        }
+        node->count[c]++;
+        node = node->child[c];
+    }
+
+    memmove(node->slots + i + 1, node->slots + i,
+            (node->n - i) * sizeof(*node->slots));
+    node->slots[i] = e;
+    node->n++;
+    return true;
+}
+
+void qindex_delete(struct qindex *idx, int i)
+{
+    struct qindex_node *node = idx->root;
+    while (node->height) {
+        int c = 0;
+        while (i >= node->count[c])
+            i -= node->count[c++];
+        node->count[c]--;
+        node = node->child[c];
+    }
+    memmove(node->slots + i, node->slots + i + 1,
+            (node->n - i - 1) * sizeof(*node->slots));
+    node->n--;
+}
@@ -0,0 +1,35 @@
+#ifndef LAB0_QINDEX_H
+#define LAB0_QINDEX_H
+
+/* Order statistic index over the elements of a queue: a counted B-tree whose
+ * leaves hold pointers to the elements in queue order, and whose inner nodes
+ * know how many elements each of their children covers. Finding, inserting
+ * and deleting the element at a given position take O(log n) time.
+ *
+ * Deletions never merge nodes, so a node may end up with few elements or none
+ * at all. The height only grows with insertions, which keeps it logarithmic.
+ */
+
+#include <stdbool.h>
+
+#include "queue.h"
+
+struct qindex;
+
+/* Index the @n elements of the list @head, return NULL if out of memory */
+struct qindex *qindex_new(struct list_head *head, int n);
+
+void qindex_free(struct qindex *idx);
+
+/* Return the element at position @i, which must be in range */
+element_t *qindex_at(const struct qindex *idx, int i);
+
+/* Insert @e at position @i, from 0 to the number of elements. Return false if
+ * out of memory, which may leave @idx inconsistent: it can only be freed then.
+ */
+bool qindex_insert(struct qindex *idx, int i, element_t *e);
+
+/* Remove the element at position @i, which must be in range */
+void qindex_delete(struct qindex *idx, int i);
+
+#endif /* LAB0_QINDEX_H */
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,6 +20,7 @@
 #include <time.h>
 #endif
 
+#include "bench.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -45,6 +47,8 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "element.h"
+#include "mpmc.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -86,6 +90,21 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+/* Cross-check the element count maintained by the queue against ours */
+static bool check_size()
+{
+    if (!current || !current->q)
+        return true;
+
+    int cnt = q_size(current->q);
+    if (cnt != current->size) {
+        report(1, "ERROR: Queue reports %d elements, but %d are expected", cnt,
+               current->size);
+        return false;
+    }
+    return true;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -196,6 +215,54 @@ static void fill_Xorshift_string(char *buf, size_t buf_size)
     buf[len] = '\0';  // 結尾
 }
 
+/* Insert reps copies of the same string with a single bulk insertion */
+static bool queue_insert_bulk(position_t pos, char *inserts, int reps)
+{
+    bool ok = true;
+    int cnt = pos == POS_TAIL ? q_insert_tail_bulk(current->q, inserts, reps)
+                              : q_insert_head_bulk(current->q, inserts, reps);
+    current->size += cnt;
+
+    if (cnt) {
+        element_t *entry = pos == POS_TAIL
+                               ? list_last_entry(current->q, element_t, list)
+                               : list_first_entry(current->q, element_t, list);
+        struct list_head *other =
+            pos == POS_TAIL ? entry->list.prev : entry->list.next;
+        if (!entry->value) {
+            report(1, "ERROR: Failed to save copy of string in queue");
+            ok = false;
+        } else if (inserts == entry->value) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            ok = false;
+        } else if (cnt > 1 && !q_intern &&
+                   list_entry(other, element_t, list)->value == entry->value) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each queue "
+                   "element");
+            ok = false;
+        }
+    }
+
+    if (cnt < reps) {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Insertion of %s failed after %d of %d elements",
+                   inserts, cnt, reps);
+        else {
+            report(1,
+                   "ERROR: Insertion of %s failed after %d of %d elements (%d "
+                   "failures total)",
+                   inserts, cnt, reps, fail_count);
+            ok = false;
+        }
+    }
+
+    return ok && !error_check();
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -248,7 +315,13 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
-    if (current && exception_setup(true)) {
+    /* Repeated insertions of a fixed string go through the bulk API */
+    bool bulk = reps > 1 && !need_rand && !need_Xorshift;
+
+    if (current && bulk) {
+        if (exception_setup(true))
+            ok = queue_insert_bulk(pos, inserts, reps);
+    } else if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
@@ -273,7 +346,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (r == 1 && lasts == cur_inserts && !q_intern) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
@@ -297,6 +370,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
     exception_cancel();
 
+    ok = ok && check_size();
     q_show(3);
     return ok;
 }
@@ -313,6 +387,82 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* How many elements 'rh str n' and 'rt str n' remove per call */
+#define REMOVE_BATCH 1024
+
+/* Remove reps elements with the bulk removal API and compare each removed
+ * string with checks.
+ */
+static bool queue_remove_bulk(position_t pos, char *checks, int reps)
+{
+    size_t bufsize = string_length + 1;
+    char *removes = malloc(REMOVE_BATCH * bufsize + STRINGPAD);
+    if (!removes) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        return false;
+    }
+
+    bool ok = true;
+    int total = 0;
+    while (ok && total < reps) {
+        int want = reps - total < REMOVE_BATCH ? reps - total : REMOVE_BATCH;
+        memset(removes, 'X', want * bufsize + STRINGPAD);
+
+        LIST_HEAD(drained);
+        int cnt = 0;
+        if (exception_setup(true))
+            cnt = pos == POS_TAIL ? q_remove_tail_n(current->q, &drained, want,
+                                                    removes, bufsize)
+                                  : q_remove_head_n(current->q, &drained, want,
+                                                    removes, bufsize);
+        exception_cancel();
+
+        // The removed elements are released by the caller as well
+        q_release_list(&drained);
+        current->size -= cnt;
+        total += cnt;
+
+        for (int i = 0; ok && i < cnt; i++) {
+            char *sp = removes + i * bufsize;
+            if (!memchr(sp, '\0', bufsize)) {
+                report(1,
+                       "ERROR: Removed string %d is not terminated within its "
+                       "buffer",
+                       total - cnt + i);
+                ok = false;
+            } else if (strcmp(sp, checks)) {
+                report(1, "ERROR: Removed value %s != expected value %s", sp,
+                       checks);
+                ok = false;
+            }
+        }
+
+        /* Buffers past the last removed element must be left untouched */
+        for (size_t i = cnt * bufsize; ok && i < want * bufsize + STRINGPAD;
+             i++) {
+            if (removes[i] != 'X') {
+                report(1,
+                       "ERROR: copying of strings in bulk removal overflowed "
+                       "destination buffer.");
+                ok = false;
+            }
+        }
+
+        if (cnt < want) {
+            fail_count++;
+            report(1, "ERROR: Removal from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+        ok = ok && !error_check();
+    }
+    report(2, "Removed %d elements from queue", total);
+
+    free(removes);
+    return ok;
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -337,11 +487,41 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc != 1 && argc != 2 && argc != 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 3) {
+        int reps = 0;
+        if (!get_int(argv[2], &reps) || reps < 1) {
+            report(1, "Invalid number of removals '%s'", argv[2]);
+            return false;
+        }
+        if (!current || !current->q) {
+            report(3, "Warning: Calling remove %s on null queue",
+                   pos == POS_TAIL ? "tail" : "head");
+            return false;
+        }
+
+        char *checks = malloc(string_length + 1);
+        if (!checks) {
+            report(1,
+                   "INTERNAL ERROR.  Could not allocate space for removed "
+                   "strings");
+            return false;
+        }
+        strncpy(checks, argv[1], string_length + 1);
+        checks[string_length] = '\0';
+
+        bool ok = queue_remove_bulk(pos, checks, reps);
+        free(checks);
+
+        ok = ok && check_size();
+        q_show(3);
+        return ok && !error_check();
+    }
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -425,6 +605,7 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         ok = false;
     }
 
+    ok = ok && check_size();
     q_show(3);
 
     free(removes);
@@ -442,12 +623,57 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Remove from @l every element whose string occurs more than once in it and
+ * return how many were removed, or -1 if out of memory.
+ */
+static int drop_repeated(struct list_head *l)
+{
+    size_t n = 0;
+    element_t *item, *tmp;
+    list_for_each_entry(item, l, list)
+        n++;
+    if (!n)
+        return 0;
+
+    char **vals = malloc(n * sizeof(char *));
+    if (!vals)
+        return -1;
+    n = 0;
+    list_for_each_entry(item, l, list)
+        vals[n++] = item->value;
+    qsort(vals, n, sizeof(char *), cmp_str);
+
+    /* The strings are compared until the end, so keep the elements till then */
+    LIST_HEAD(dropped);
+    list_for_each_entry_safe(item, tmp, l, list) {
+        char **p = bsearch(&item->value, vals, n, sizeof(char *), cmp_str);
+        if ((p > vals && !strcmp(p[-1], item->value)) ||
+            (p + 1 < vals + n && !strcmp(p[1], item->value)))
+            list_move_tail(&item->list, &dropped);
+    }
+    free(vals);
+
+    int cnt = 0;
+    list_for_each_entry_safe(item, tmp, &dropped, list) {
+        free(item->value);
+        free(item);
+        cnt++;
+    }
+    return cnt;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "hash"))) {
+        report(1, "%s takes no arguments or 'hash'", argv[0]);
         return false;
     }
+    bool hash = argc == 2;
 
     if (!current || !current->q) {
         report(3, "Warning: Try to access null queue");
@@ -487,17 +713,41 @@ static bool do_dedup(int argc, char *argv[])
         }
     }
 
+    /* Without adjacent duplicates left, the check below expects the strings
+     * occurring once, in their original order.
+     */
+    int dropped = 0;
+    if (hash) {
+        dropped = drop_repeated(&l_copy);
+        if (dropped < 0) {
+            list_for_each_entry_safe(item, tmp, &l_copy, list) {
+                free(item->value);
+                free(item);
+            }
+            report(1,
+                   "INTERNAL ERROR.  Could not allocate space for "
+                   "duplicate checking");
+            return false;
+        }
+        current->size -= dropped;
+    }
+
     bool ok = true;
+    q_dedup_hash = hash;
     if (exception_setup(true))
         ok = q_delete_dup(current->q);
     exception_cancel();
+    q_dedup_hash = 0;
 
     if (!ok) {
         list_for_each_entry_safe(item, tmp, &l_copy, list) {
             free(item->value);
             free(item);
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        current->size += dropped;
+        report(1, hash ? "ERROR: Calling delete duplicate on null queue, or "
+                         "out of memory for the hash set"
+                       : "ERROR: Calling delete duplicate on null queue");
         return false;
     }
 
@@ -533,6 +783,7 @@ static bool do_dedup(int argc, char *argv[])
         free(item);
     }
 
+    ok = ok && check_size();
     q_show(3);
     return ok && !error_check();
 }
@@ -650,20 +901,20 @@ bool do_sort(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            int ret = element_cmp(item, next_item);
+            if (!descend && ret > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && ret < 0) {
                 report(1, "ERROR: Not sorted in descending order");
                 ok = false;
                 break;
             }
             /* Ensure the stability of the sort */
-            if (current->size <= MAX_NODES &&
-                !strcmp(item->value, next_item->value)) {
+            if (current->size <= MAX_NODES && !ret) {
                 bool unstable = false;
                 for (unsigned i = 0; i < MAX_NODES; i++) {
                     if (nodes[i] == cur_l->next) {
@@ -692,6 +943,471 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/**
+ * struct bench_pair - Queues of a benchmark comparing two modes
+ * @q: one queue per mode, NULL once freed
+ * @n: number of strings in each queue
+ * @b: measurement shared by both modes
+ *
+ * Both queues are built together out of the same strings, so that their
+ * elements are laid out alike in memory and neither mode is favored.
+ */
+struct bench_pair {
+    struct list_head *q[2];
+    int n;
+    bench_t b;
+};
+
+/* Build the queues of @p out of @n strings of at most @bufsize - 1 bytes, the
+ * i-th one written by @fill to the buffer it gets for string i. The buffer is
+ * the same for every string, so that it keeps what @fill does not overwrite.
+ */
+static bool bench_pair_new(struct bench_pair *p,
+                           int n,
+                           size_t bufsize,
+                           void (*fill)(char *buf, int i, void *priv),
+                           void *priv)
+{
+    p->q[0] = q_new();
+    p->q[1] = q_new();
+    p->n = n;
+    bench_init(&p->b);
+
+    char *buf = malloc_or_fail(bufsize, "bench_pair_new");
+    bool ok = p->q[0] && p->q[1];
+    for (int i = 0; ok && i < n; i++) {
+        fill(buf, i, priv);
+        ok = q_insert_tail(p->q[0], buf) && q_insert_tail(p->q[1], buf);
+    }
+    free_block(buf, bufsize);
+    if (!ok)
+        report(1, "ERROR: Could not build queues of %d strings", n);
+    return ok;
+}
+
+/* Free the queues left in @p, without cautious mode making it quadratic */
+static void bench_pair_free(struct bench_pair *p)
+{
+    bench_exit(&p->b);
+    set_cautious_mode(false);
+    q_free(p->q[0]);
+    q_free(p->q[1]);
+    set_cautious_mode(true);
+}
+
+/* Run @op on each mode in turn, with *@option, unless NULL, set to the mode
+ * and the counters cleared. @op measures with @p->b whatever it times, and
+ * returns false to stop. Most benchmarks release many elements, so cautious
+ * mode is off meanwhile.
+ */
+static bool bench_pair_run(struct bench_pair *p,
+                           int *option,
+                           bool (*op)(struct bench_pair *p, int mode))
+{
+    int saved = option ? *option : 0;
+    bool ok = true;
+    set_cautious_mode(false);
+    for (int mode = 0; ok && mode < 2; mode++) {
+        if (option)
+            *option = mode;
+        memset(&q_stats, 0, sizeof(q_stats));
+        ok = false;
+        if (exception_setup(false))
+            ok = op(p, mode);
+        exception_cancel();
+    }
+    set_cautious_mode(true);
+    if (option)
+        *option = saved;
+    return ok;
+}
+
+/* Write a string of random letters, of the length @priv points to */
+static void fill_random(char *buf, int i, void *priv)
+{
+    int len = *(int *) priv;
+    for (int j = 0; j < len; j++)
+        buf[j] = charset[rand() % (sizeof(charset) - 1)];
+    buf[len] = '\0';
+}
+
+/* Default size of the sort benchmark */
+#define SORTBENCH_NODES 100000
+#define SORTBENCH_LEN 32
+
+static bool sortbench_run(struct bench_pair *p, int mode)
+{
+    bench_t *b = &p->b;
+    bench_start(b);
+    q_sort(p->q[mode], false);
+    bench_stop(b);
+
+    char misses[32] = "n/a", ratio[32] = "n/a";
+    if (b->cache_misses >= 0) {
+        snprintf(misses, sizeof(misses), "%lld", (long long) b->cache_misses);
+        if (b->cache_misses)
+            snprintf(ratio, sizeof(ratio), "%.2f",
+                     (double) q_stats.cmps / b->cache_misses);
+    }
+    report(1,
+           "prefix %-3s: %.3f s, %llu comparisons, %llu string reads, "
+           "%s cache misses, %s comparisons per miss",
+           mode ? "on" : "off", b->ns / 1e9, (unsigned long long) q_stats.cmps,
+           (unsigned long long) q_stats.cmp_reads, misses, ratio);
+    return true;
+}
+
+static bool do_sortbench(int argc, char *argv[])
+{
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n = SORTBENCH_NODES, len = SORTBENCH_LEN;
+    if (argc > 1 && (!get_int(argv[1], &n) || n < 1)) {
+        report(1, "Invalid number of strings '%s'", argv[1]);
+        return false;
+    }
+    if (argc > 2 && (!get_int(argv[2], &len) || len < 1)) {
+        report(1, "Invalid string length '%s'", argv[2]);
+        return false;
+    }
+
+    struct bench_pair p;
+    bool ok = bench_pair_new(&p, n, len + 1, fill_random, &len);
+    if (ok && p.b.fd < 0)
+        report(1, "Cache miss counter unavailable, reporting string reads");
+    ok = ok && bench_pair_run(&p, &q_cmp_prefix, sortbench_run);
+    bench_pair_free(&p);
+    return ok && !error_check();
+}
+
+/* Default size of the comparison benchmark, whose strings only differ in
+ * their last CMPBENCH_TAIL bytes.
+ */
+#define CMPBENCH_NODES 100000
+#define CMPBENCH_LEN 256
+#define CMPBENCH_TAIL 4
+
+/* Write a string of the length @priv points to, whose random prefix is the
+ * same for every string and only the last CMPBENCH_TAIL letters vary
+ */
+static void fill_shared_prefix(char *buf, int i, void *priv)
+{
+    int len = *(int *) priv;
+    if (!i) {
+        for (int j = 0; j < len - CMPBENCH_TAIL; j++)
+            buf[j] = charset[rand() % (sizeof(charset) - 1)];
+        buf[len] = '\0';
+    }
+    for (int j = len - CMPBENCH_TAIL; j < len; j++)
+        buf[j] = charset[rand() % (sizeof(charset) - 1)];
+}
+
+static bool cmpbench_run(struct bench_pair *p, int mode)
+{
+    bench_start(&p->b);
+    q_sort(p->q[mode], false);
+    bench_stop(&p->b);
+    report(1, "%-6s: %.3f s, %llu string reads, %.1f ns per read",
+           mode ? "kernel" : "memcmp", p->b.ns / 1e9,
+           (unsigned long long) q_stats.cmp_reads,
+           q_stats.cmp_reads ? (double) p->b.ns / q_stats.cmp_reads : 0.0);
+    return true;
+}
+
+static bool do_cmpbench(int argc, char *argv[])
+{
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n = CMPBENCH_NODES, len = CMPBENCH_LEN;
+    if (argc > 1 && (!get_int(argv[1], &n) || n < 1)) {
+        report(1, "Invalid number of strings '%s'", argv[1]);
+        return false;
+    }
+    if (argc > 2 && (!get_int(argv[2], &len) || len < CMPBENCH_TAIL)) {
+        report(1, "Invalid string length '%s'", argv[2]);
+        return false;
+    }
+
+    struct bench_pair p;
+    bool ok = bench_pair_new(&p, n, len + 1, fill_shared_prefix, &len) &&
+              bench_pair_run(&p, &q_cmp_simd, cmpbench_run);
+    bench_pair_free(&p);
+    return ok && !error_check();
+}
+
+/* Default size of the deduplication benchmark */
+#define DEDUPBENCH_NODES 1000000
+
+/* Write one of n values drawn at random, n being what @priv points to, so
+ * that about a third of n strings are unique
+ */
+static void fill_dedup(char *buf, int i, void *priv)
+{
+    int j = 0;
+    for (unsigned int v = rand() % *(int *) priv; j == 0 || v; v /= 26)
+        buf[j++] = charset[v % 26];
+    buf[j] = '\0';
+}
+
+static bool dedupbench_run(struct bench_pair *p, int mode)
+{
+    bench_start(&p->b);
+    if (!mode)
+        q_sort(p->q[mode], false);
+    bool done = q_delete_dup(p->q[mode]);
+    bench_stop(&p->b);
+    if (!done) {
+        report(1, "ERROR: Deleting duplicates failed");
+        return false;
+    }
+    report(1, "%-10s: %.3f s, %d strings left", mode ? "hash" : "sort+dedup",
+           p->b.ns / 1e9, q_size(p->q[mode]));
+    return true;
+}
+
+static bool do_dedupbench(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int n = DEDUPBENCH_NODES;
+    if (argc > 1 && (!get_int(argv[1], &n) || n < 1)) {
+        report(1, "Invalid number of strings '%s'", argv[1]);
+        return false;
+    }
+
+    struct bench_pair p;
+    bool ok = bench_pair_new(&p, n, 16, fill_dedup, &n) &&
+              bench_pair_run(&p, &q_dedup_hash, dedupbench_run);
+    if (ok && q_size(p.q[0]) != q_size(p.q[1])) {
+        report(1, "ERROR: Both ways should leave as many strings");
+        ok = false;
+    }
+    bench_pair_free(&p);
+    return ok && !error_check();
+}
+
+/* Default size of the traversal benchmark, large enough for the elements and
+ * their strings to outgrow the last level cache.
+ */
+#define WALKBENCH_NODES 4000000
+
+/* Sort the queue, so that it gets scattered over memory as its strings are
+ * random, then free it. The queue is dropped from @p before it is freed, so
+ * that an interrupted free is not done again by bench_pair_free().
+ */
+static bool walkbench_run(struct bench_pair *p, int mode)
+{
+    struct list_head *q = p->q[mode];
+    uint64_t ns[2];
+    bench_start(&p->b);
+    q_sort(q, false);
+    bench_stop(&p->b);
+    ns[0] = p->b.ns;
+    p->q[mode] = NULL;
+    bench_start(&p->b);
+    q_free(q);
+    bench_stop(&p->b);
+    ns[1] = p->b.ns;
+    report(1, "prefetch %-3s: sort %.1f ns/node, free %.1f ns/node",
+           mode ? "on" : "off", (double) ns[0] / p->n, (double) ns[1] / p->n);
+    return true;
+}
+
+static bool do_walkbench(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int n = WALKBENCH_NODES, len = SORTBENCH_LEN;
+    if (argc > 1 && (!get_int(argv[1], &n) || n < 1)) {
+        report(1, "Invalid number of strings '%s'", argv[1]);
+        return false;
+    }
+
+    struct bench_pair p;
+    bool ok = bench_pair_new(&p, n, len + 1, fill_random, &len) &&
+              bench_pair_run(&p, &q_prefetch, walkbench_run);
+    bench_pair_free(&p);
+    return ok && !error_check();
+}
+
+/* Default number of insertions of the concurrent queue benchmark, shared by
+ * the threads, and default maximum number of threads
+ */
+#define MPMCBENCH_OPS 1000000
+#define MPMCBENCH_THREADS 4
+#define MPMCBENCH_MAX_THREADS 64
+
+/**
+ * struct mpmc_worker - One thread of the concurrent queue benchmark
+ * @q: queue shared by all threads
+ * @start: held by the main thread until every thread is created
+ * @id: number of the thread, from 0
+ * @nthreads: number of threads
+ * @ops: number of insertions, each followed by a removal
+ * @failed: number of insertions that failed
+ * @inserted: number of strings inserted
+ * @removed: number of strings removed
+ * @sum_in: sum of the numbers written in the inserted strings
+ * @sum_out: sum of the numbers read from the removed strings
+ */
+struct mpmc_worker {
+    struct mpmc *q;
+    pthread_rwlock_t *start;
+    int id, nthreads;
+    long ops, failed;
+    unsigned long long inserted, removed;
+    unsigned long long sum_in, sum_out;
+};
+
+static void *mpmc_worker_run(void *arg)
+{
+    struct mpmc_worker *w = arg;
+    char buf[32];
+
+    pthread_rwlock_rdlock(w->start);
+    pthread_rwlock_unlock(w->start);
+    struct mpmc_thread *t = mpmc_join(w->q);
+    if (!t) {
+        w->failed = w->ops;
+        return NULL;
+    }
+    for (long i = 0; i < w->ops; i++) {
+        unsigned long long v = (unsigned long long) i * w->nthreads + w->id;
+        snprintf(buf, sizeof(buf), "%llu", v);
+        if (mpmc_insert_tail(t, buf)) {
+            w->inserted++;
+            w->sum_in += v;
+        } else {
+            w->failed++;
+        }
+        element_t *e = mpmc_remove_head(t, buf, sizeof(buf));
+        if (e) {
+            w->removed++;
+            w->sum_out += strtoull(buf, NULL, 10);
+            mpmc_release_element(e);
+        }
+    }
+    mpmc_leave(t);
+    return NULL;
+}
+
+static bool do_mpmcbench(int argc, char *argv[])
+{
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n = MPMCBENCH_OPS, max_threads = MPMCBENCH_THREADS;
+    if (argc > 1 && (!get_int(argv[1], &n) || n < 1)) {
+        report(1, "Invalid number of insertions '%s'", argv[1]);
+        return false;
+    }
+    if (argc > 2 && (!get_int(argv[2], &max_threads) || max_threads < 1 ||
+                     max_threads > MPMCBENCH_MAX_THREADS)) {
+        report(1, "Invalid number of threads '%s', from 1 to %d", argv[2],
+               MPMCBENCH_MAX_THREADS);
+        return false;
+    }
+
+    /* Every thread inserts its own numbers and removes whichever comes first,
+     * so that all of them produce and consume at once. What went in has to
+     * come out, during the run or when draining the queue after it.
+     */
+    bool ok = true;
+    double base = 0;
+    bench_t b;
+    bench_init(&b);
+    for (int t = 1; ok && t <= max_threads; t++) {
+        struct mpmc *q = mpmc_new();
+        if (!q) {
+            report(1, "ERROR: Could not create a concurrent queue");
+            ok = false;
+            break;
+        }
+
+        pthread_rwlock_t start;
+        pthread_rwlock_init(&start, NULL);
+        pthread_rwlock_wrlock(&start);
+        struct mpmc_worker workers[MPMCBENCH_MAX_THREADS];
+        pthread_t threads[MPMCBENCH_MAX_THREADS];
+        int started = 0;
+        for (int i = 0; i < t; i++) {
+            workers[i] = (struct mpmc_worker){
+                .q = q,
+                .start = &start,
+                .id = i,
+                .nthreads = t,
+                .ops = n / t + (i < n % t),
+            };
+            if (pthread_create(&threads[i], NULL, mpmc_worker_run,
+                               &workers[i]))
+                break;
+            started++;
+        }
+        bench_start(&b);
+        pthread_rwlock_unlock(&start);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        bench_stop(&b);
+        pthread_rwlock_destroy(&start);
+
+        unsigned long long inserted = 0, removed = 0, sum_in = 0, sum_out = 0;
+        long failed = 0;
+        for (int i = 0; i < started; i++) {
+            failed += workers[i].failed;
+            inserted += workers[i].inserted;
+            removed += workers[i].removed;
+            sum_in += workers[i].sum_in;
+            sum_out += workers[i].sum_out;
+        }
+        char buf[32];
+        element_t *e;
+        struct mpmc_thread *self = mpmc_join(q);
+        while (self && (e = mpmc_remove_head(self, buf, sizeof(buf)))) {
+            removed++;
+            sum_out += strtoull(buf, NULL, 10);
+            mpmc_release_element(e);
+        }
+        mpmc_leave(self);
+        mpmc_free(q);
+
+        if (started < t) {
+            report(1, "ERROR: Could only start %d of %d threads", started, t);
+            ok = false;
+        } else if (failed || !self) {
+            report(1, "ERROR: Out of memory, %ld insertions failed", failed);
+            ok = false;
+        } else if (inserted != removed || sum_in != sum_out) {
+            report(1,
+                   "ERROR: %llu strings inserted but %llu removed, or not "
+                   "the same ones",
+                   inserted, removed);
+            ok = false;
+        } else {
+            double rate = (inserted + removed) / (b.ns / 1e9);
+            if (t == 1)
+                base = rate;
+            report(1, "threads %2d: %.2f Mops/s, %.2fx", t, rate / 1e6,
+                   rate / base);
+        }
+    }
+    bench_exit(&b);
+    return ok && !error_check();
+}
+
 static bool do_dm(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -714,6 +1430,117 @@ static bool do_dm(int argc, char *argv[])
         report(3, "Warning: Try to delete middle node to empty queue");
     else
         --current->size;
+    ok = ok && check_size();
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* Parse the position argument of at, delat and insat */
+static bool get_position(int argc, char *argv[], int nargs, int *i)
+{
+    if (argc != nargs + 1) {
+        report(1, "%s needs %d argument%s", argv[0], nargs,
+               nargs > 1 ? "s" : "");
+        return false;
+    }
+    if (!get_int(argv[1], i)) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
+    }
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    return true;
+}
+
+static bool do_at(int argc, char *argv[])
+{
+    int i;
+    if (!get_position(argc, argv, 1, &i))
+        return false;
+    error_check();
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = q_at(current->q, i);
+    exception_cancel();
+
+    bool ok = true;
+    if (i < 0 || i >= current->size) {
+        if (e) {
+            report(1, "ERROR: Found an element at position %d, out of range",
+                   i);
+            ok = false;
+        } else {
+            report(3, "Warning: Position %d is out of range", i);
+        }
+    } else if (!e) {
+        report(1, "ERROR: Could not find the element at position %d", i);
+        ok = false;
+    } else {
+        report(1, "Element at %d: %s", i, e->value);
+    }
+    return ok && !error_check();
+}
+
+static bool do_delat(int argc, char *argv[])
+{
+    int i;
+    if (!get_position(argc, argv, 1, &i))
+        return false;
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_delete_at(current->q, i);
+    exception_cancel();
+
+    if (i < 0 || i >= current->size) {
+        report(3, "Warning: Try to delete at position %d, out of range", i);
+        if (ok) {
+            report(1, "ERROR: Deleted an element at a position out of range");
+            ok = false;
+        }
+    } else if (ok) {
+        --current->size;
+    }
+    ok = ok && check_size();
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_insat(int argc, char *argv[])
+{
+    int i;
+    if (!get_position(argc, argv, 2, &i))
+        return false;
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_insert_at(current->q, i, argv[2]);
+    exception_cancel();
+
+    if (i < 0 || i > current->size) {
+        report(3, "Warning: Try to insert at position %d, out of range", i);
+        if (ok) {
+            report(1, "ERROR: Inserted an element at a position out of range");
+            ok = false;
+        }
+    } else if (ok) {
+        ++current->size;
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Insertion of %s failed", argv[2]);
+            ok = true;
+        } else {
+            report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                   argv[2], fail_count);
+        }
+    }
+    ok = ok && check_size();
     q_show(3);
     return ok && !error_check();
 }
@@ -777,7 +1604,7 @@ static bool do_ascend(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) > 0) {
+            if (element_cmp(item, next_item) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -786,6 +1613,7 @@ static bool do_ascend(int argc, char *argv[])
         }
     }
 
+    ok = ok && check_size();
     q_show(3);
     return ok && !error_check();
 }
@@ -824,7 +1652,7 @@ static bool do_descend(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) < 0) {
+            if (element_cmp(item, next_item) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -833,6 +1661,7 @@ static bool do_descend(int argc, char *argv[])
         }
     }
 
+    ok = ok && check_size();
     q_show(3);
     return ok && !error_check();
 }
@@ -863,14 +1692,21 @@ static bool do_reverseK(int argc, char *argv[])
     exception_cancel();
 
     set_noallocate_mode(false);
+    bool ok = check_size();
     q_show(3);
-    return !error_check();
+    return ok && !error_check();
 }
 
 static bool do_merge(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int threads = 1;
+    if (argc > 1 && (!get_int(argv[1], &threads) || threads < 1)) {
+        report(1, "Invalid number of threads '%s'", argv[1]);
         return false;
     }
 
@@ -882,12 +1718,14 @@ static bool do_merge(int argc, char *argv[])
 
     int len = 0;
     set_noallocate_mode(true);
+    q_merge_threads = threads;
     if (current && exception_setup(true))
         len = q_merge(&chain.head, descend);
     exception_cancel();
+    q_merge_threads = 1;
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -912,7 +1750,7 @@ static bool do_merge(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            if (!descend && element_cmp(item, next_item) > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
                        "of unsorted queues are merged or there're some flaws "
@@ -922,7 +1760,7 @@ static bool do_merge(int argc, char *argv[])
             }
 
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && element_cmp(item, next_item) < 0) {
                 report(
                     1,
                     "ERROR: Not sorted in descending order (It might because "
@@ -934,30 +1772,41 @@ static bool do_merge(int argc, char *argv[])
         }
     }
 
+    ok = ok && check_size();
     q_show(3);
     return ok && !error_check();
 }
 
+/* Check both directions with two pointers each. The fast one gets back to the
+ * head after a single lap of a circular list, and catches up with the slow one
+ * if the list loops anywhere else, so that no node is visited more than twice.
+ */
 static bool is_circular()
 {
-    struct list_head *cur = current->q->next;
-    struct list_head *fast = (cur) ? cur->next : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->next)
-            return false;
-        if (cur == fast)
+    struct list_head *head = current->q;
+    struct list_head *slow = head, *fast = head->next;
+    while (fast != head) {
+        if (!fast || !fast->next)
             return false;
-        cur = cur->next;
+        if (fast->next == head)
+            break;
         fast = fast->next->next;
+        slow = slow->next;
+        if (fast == slow)
+            return false;
     }
 
-    cur = current->q->prev;
-    fast = (cur) ? cur->prev : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->prev)
+    slow = head;
+    fast = head->prev;
+    while (fast != head) {
+        if (!fast || !fast->prev)
             return false;
-        cur = cur->prev;
+        if (fast->prev == head)
+            break;
         fast = fast->prev->prev;
+        slow = slow->prev;
+        if (fast == slow)
+            return false;
     }
     return true;
 }
@@ -1081,31 +1930,42 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
-// void q_shuffle(struct list_head *head);
-
-// static bool do_shuffle(int argc, char *argv[])
-//{
-//    if (argc != 1) {
-//         report(1, "%s takes no arguments", argv[0]);
-//        return false;
-//     }
+static bool do_shuffle(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
 
-//    if (!current || !current->q) {
-//        report(3, "Warning: Try to access null queue");
-//        return false;
-//    }
-//    error_check();
+    int seed = 0;
+    uint64_t state;
+    if (argc > 1) {
+        if (!get_int(argv[1], &seed)) {
+            report(1, "Invalid seed '%s'", argv[1]);
+            return false;
+        }
+        state = (uint64_t) seed;
+    } else {
+        randombytes((uint8_t *) &state, sizeof(state));
+    }
 
-//    set_noallocate_mode(true);
-//    if (exception_setup(true))
-//        q_shuffle(current->q);
-//    exception_cancel();
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
 
-//    set_noallocate_mode(false);
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_shuffle(current->q, state);
+    exception_cancel();
+    if (!ok)
+        report(1, "ERROR: Could not shuffle queue");
 
-//    q_show(3);
-//    return !error_check();
-//}
+    ok = ok && check_size();
+    q_show(3);
+    return ok && !error_check();
+}
 
 static void console_init()
 {
@@ -1121,21 +1981,54 @@ static void console_init()
                 "Insert string str at tail of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
                 "str [n]");
-    ADD_COMMAND(
-        rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
-    ADD_COMMAND(
-        rt,
-        "Remove from tail of queue. Optionally compare to expected value str",
-        "[str]");
+    ADD_COMMAND(rh,
+                "Remove from head of queue. Optionally compare to expected "
+                "value str. With n, remove n elements in batches and compare "
+                "each of them",
+                "[str [n]]");
+    ADD_COMMAND(rt,
+                "Remove from tail of queue. Optionally compare to expected "
+                "value str. With n, remove n elements in batches and compare "
+                "each of them",
+                "[str [n]]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descending order", "");
+    ADD_COMMAND(sortbench,
+                "Sort n random strings of the given length with and without "
+                "the cached prefixes and report the comparison statistics",
+                "[n [len]]");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
-    ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
-    ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
+    ADD_COMMAND(at, "Show the element at position i of queue", "i");
+    ADD_COMMAND(delat, "Delete the element at position i of queue", "i");
+    ADD_COMMAND(insat, "Insert str at position i of queue", "i str");
+    ADD_COMMAND(dedup,
+                "Delete all nodes that have duplicate string, anywhere in "
+                "the queue with hash",
+                "[hash]");
+    ADD_COMMAND(dedupbench,
+                "Delete the duplicates among n random strings after sorting "
+                "them, and with a hash set",
+                "[n]");
+    ADD_COMMAND(cmpbench,
+                "Sort n strings of the given length, all alike but for their "
+                "last bytes, with memcmp() and with the vector kernel",
+                "[n [len]]");
+    ADD_COMMAND(walkbench,
+                "Sort and free n random strings, larger than the last level "
+                "cache by default, with and without prefetching and report "
+                "the time per node",
+                "[n]");
+    ADD_COMMAND(mpmcbench,
+                "Insert and remove n strings with 1 to t threads sharing a "
+                "concurrent queue, checking that none is lost, and report "
+                "the operations per second",
+                "[n [t]]");
+    ADD_COMMAND(merge,
+                "Merge all the queues into one sorted queue, merging pairs "
+                "of queues on the given number of threads",
+                "[threads]");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
     ADD_COMMAND(ascend,
                 "Remove every node which has a node with a strictly less "
@@ -1147,7 +2040,10 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
-    //  ADD_COMMAND(shuffle, "Fisher-Yates shuffle Algorithm", "");
+    ADD_COMMAND(shuffle,
+                "Shuffle queue with Fisher-Yates, reproducibly for a given "
+                "seed",
+                "[seed]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1156,6 +2052,28 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("slab", &q_use_slab,
+              "Allocate elements of new queues from a per-queue slab", NULL);
+    add_param("intern", &q_intern,
+              "Share one copy of equal strings too long to be stored inline",
+              NULL);
+    add_param("prefix", &q_cmp_prefix,
+              "Decide string comparisons on cached prefixes when possible",
+              NULL);
+    add_param("sortalgo", &q_sortalgo,
+              "Sort algorithm: 0 bottom-up, 1 top-down, 2 list_sort, "
+              "3 quicksort, 4 natural",
+              NULL);
+    add_param("threads", &q_sort_threads,
+              "Number of threads sorting large queues", NULL);
+    add_param("simd", &q_cmp_simd,
+              "Compare strings with the vector kernel instead of memcmp()",
+              NULL);
+    add_param("prefetch", &q_prefetch,
+              "Prefetch ahead of the walks along long lists", NULL);
+    add_param("index", &q_index,
+              "Find elements by position through an order statistic index",
+              NULL);
 }
 
 /* Signal handlers */
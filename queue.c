@@ -1,25 +1,141 @@
 #include "queue.h"
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "element.h"
+#include "qindex.h"
+
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
  * following line.
  *   cppcheck-suppress nullPointer
  */
 
+/**
+ * queue_t - Header of a queue
+ * @head: list head handed out to the callers, must be the first member
+ * @size: number of elements in the queue
+ * @slab: element allocator of this queue, NULL to use malloc
+ * @mid: middle node, the one at index @size / 2 counting from 0, or NULL if
+ *       the queue is empty or it has to be found again
+ * @index: order statistic index of the elements, built on demand
+ * @indexed: @index reflects the list
+ *
+ * Every operation adding or removing elements keeps @size up to date so that
+ * q_size() does not have to walk the list. Insertions and removals of single
+ * elements move the middle by at most one node and keep @mid on it, so that
+ * q_delete_mid() takes constant time, and update @index if it is in use. The
+ * other operations moving elements around reset both, and the next operation
+ * looking for a position walks or builds the index again.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct slab *slab;
+    struct list_head *mid;
+    struct qindex *index;
+    bool indexed;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/* Account for @node, just linked in at index @i of @q, which is not counted
+ * in @q->size yet.
+ */
+static void positions_add(queue_t *q, int i, struct list_head *node)
+{
+    int m = q->size / 2;
+    if (!q->size)
+        q->mid = node;
+    else if (q->mid && i <= m && !(q->size & 1))
+        q->mid = q->mid->prev;
+    else if (q->mid && i > m && (q->size & 1))
+        q->mid = q->mid->next;
+
+    if (q->indexed &&
+        !qindex_insert(q->index, i, list_entry(node, element_t, list)))
+        q->indexed = false;
+}
+
+/* Account for the node at index @i of @q, which is about to be unlinked */
+static void positions_del(queue_t *q, int i)
+{
+    int m = q->size / 2;
+    if (q->size == 1)
+        q->mid = NULL;
+    else if (q->mid && i == m)
+        q->mid = (q->size & 1) ? q->mid->next : q->mid->prev;
+    else if (q->mid && i < m && (q->size & 1))
+        q->mid = q->mid->next;
+    else if (q->mid && i > m && !(q->size & 1))
+        q->mid = q->mid->prev;
+
+    if (q->indexed)
+        qindex_delete(q->index, i);
+}
+
+/* Forget every position after an operation moving many elements around. The
+ * index is only freed when it is built again, since the operations not
+ * allowed to free memory get here too.
+ */
+static inline void positions_reset(queue_t *q)
+{
+    q->mid = NULL;
+    q->indexed = false;
+}
+
+/* Return the node at index @i of @q, through the index if q_index is set and
+ * memory allows, otherwise walking from the nearer end.
+ */
+static struct list_head *node_at(queue_t *q, int i)
+{
+    if (q_index && !q->indexed) {
+        qindex_free(q->index);
+        q->index = qindex_new(&q->head, q->size);
+        q->indexed = q->index != NULL;
+    }
+    if (q->indexed)
+        return &qindex_at(q->index, i)->list;
+
+    struct list_head *node;
+    if (i < q->size / 2) {
+        for (node = q->head.next; i; i--)
+            node = node->next;
+    } else {
+        for (node = q->head.prev; ++i < q->size;)
+            node = node->prev;
+    }
+    return node;
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *new_qhead =
-        (struct list_head *) malloc(sizeof(struct list_head));
-    if (!new_qhead) {
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q) {
         return NULL;
     }
-    INIT_LIST_HEAD(new_qhead);
-    return new_qhead;
+    q->size = 0;
+    q->slab = NULL;
+    q->mid = NULL;
+    q->index = NULL;
+    q->indexed = false;
+    if (q_use_slab) {
+        q->slab = slab_new();
+        if (!q->slab) {
+            free(q);
+            return NULL;
+        }
+    }
+    INIT_LIST_HEAD(&q->head);
+    return &q->head;
 }
 
 /* Free all storage used by queue */
@@ -28,13 +144,16 @@ void q_free(struct list_head *head)
     if (!head) {
         return;
     }
+    struct slab *slab = to_queue(head)->slab;
     struct list_head *node, *safe;
     list_for_each_safe (node, safe, head) {
-        element_t *free_node = list_entry(node, element_t, list);
-        free(free_node->value);
-        free(free_node);
+        element_prefetch_walk(safe, head);
+        element_discard(list_entry(node, element_t, list), slab);
     }
-    free(head);
+    if (slab)
+        slab_orphan(slab);
+    qindex_free(to_queue(head)->index);
+    free(to_queue(head));
 }
 
 /* Insert an element at head of queue */
@@ -43,16 +162,13 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head) {
         return false;
     }
-    element_t *new_qelement = (element_t *) malloc(sizeof(element_t));
+    element_t *new_qelement = element_new(to_queue(head)->slab, s, strlen(s) + 1);
     if (!new_qelement) {
         return false;
     }
-    new_qelement->value = strdup(s);
-    if (!new_qelement->value) {
-        free(new_qelement);
-        return false;
-    }
     list_add(&new_qelement->list, head);
+    positions_add(to_queue(head), 0, &new_qelement->list);
+    to_queue(head)->size++;
     return true;
 }
 
@@ -62,9 +178,63 @@ bool q_insert_tail(struct list_head *head, char *s)
     if (!head) {
         return false;
     }
-    return q_insert_head(head->prev, s);
+    element_t *new_qelement = element_new(to_queue(head)->slab, s, strlen(s) + 1);
+    if (!new_qelement) {
+        return false;
+    }
+    list_add_tail(&new_qelement->list, head);
+    positions_add(to_queue(head), to_queue(head)->size, &new_qelement->list);
+    to_queue(head)->size++;
+    return true;
+}
+
+/* Build @n copies of @s on a private list and splice it into the queue at
+ * once, at the head or at the tail.
+ */
+static int insert_bulk(struct list_head *head, const char *s, int n, bool tail)
+{
+    if (!head || n < 1)
+        return 0;
+
+    /* A queue owning a slab carves the batch out of it, while one created
+     * without, under "option slab 0", gets a block for this batch only and
+     * keeps allocating its other elements with malloc.
+     */
+    queue_t *q = to_queue(head);
+    struct slab *slab = slab_batch_begin(q->slab, n);
+
+    LIST_HEAD(batch);
+    size_t len = strlen(s) + 1;
+    int cnt = 0;
+    while (cnt < n) {
+        element_t *e = element_new(slab, s, len);
+        if (!e)
+            break;
+        list_add_tail(&e->list, &batch);
+        cnt++;
+    }
+    slab_batch_end(q->slab, slab);
+
+    if (tail)
+        list_splice_tail(&batch, head);
+    else
+        list_splice(&batch, head);
+    q->size += cnt;
+    positions_reset(q);
+    return cnt;
+}
+
+/* Insert n copies of a string at head of queue */
+int q_insert_head_bulk(struct list_head *head, char *s, int n)
+{
+    return insert_bulk(head, s, n, false);
 }
 
+/* Insert n copies of a string at tail of queue */
+int q_insert_tail_bulk(struct list_head *head, char *s, int n)
+{
+    return insert_bulk(head, s, n, true);
+}
 
 /* Remove an element from head of queue */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
@@ -72,13 +242,11 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
     if (!head || list_empty(head)) {
         return NULL;
     }
-    if (sp) {
-        memset(sp, '\0', bufsize);
-        strncpy(sp, container_of(head->next, element_t, list)->value,
-                bufsize - 1);
-    }
     element_t *del_element_t = container_of(head->next, element_t, list);
+    element_copy(sp, del_element_t, bufsize);
+    positions_del(to_queue(head), 0);
     list_del(head->next);
+    to_queue(head)->size--;
     return del_element_t;
 }
 
@@ -88,28 +256,91 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
     if (!head || list_empty(head)) {
         return NULL;
     }
-    if (sp) {
-        memset(sp, '\0', bufsize);
-        strncpy(sp, container_of(head->prev, element_t, list)->value,
-                bufsize - 1);
-    }
     element_t *del_element_t = container_of(head->prev, element_t, list);
+    element_copy(sp, del_element_t, bufsize);
+    positions_del(to_queue(head), to_queue(head)->size - 1);
     list_del(head->prev);
+    to_queue(head)->size--;
     return del_element_t;
 }
 
+/* Remove up to n elements from head of queue */
+int q_remove_head_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize)
+{
+    if (!head || list_empty(head) || n < 1)
+        return 0;
+
+    struct list_head *node = head;
+    int cnt = 0;
+    while (cnt < n && node->next != head) {
+        node = node->next;
+        if (sp)
+            element_copy(sp + cnt * bufsize, list_entry(node, element_t, list),
+                         bufsize);
+        cnt++;
+    }
+
+    LIST_HEAD(run);
+    list_cut_position(&run, head, node);
+    list_splice_tail(&run, list);
+    to_queue(head)->size -= cnt;
+    positions_reset(to_queue(head));
+    return cnt;
+}
+
+/* Remove up to n elements from tail of queue */
+int q_remove_tail_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize)
+{
+    if (!head || list_empty(head) || n < 1)
+        return 0;
+
+    struct list_head *node = head;
+    int cnt = 0;
+    while (cnt < n && node->prev != head) {
+        node = node->prev;
+        if (sp)
+            element_copy(sp + cnt * bufsize, list_entry(node, element_t, list),
+                         bufsize);
+        cnt++;
+    }
+
+    /* Cut off what stays in the queue, take the rest and put it back */
+    LIST_HEAD(keep);
+    list_cut_position(&keep, head, node->prev);
+    list_splice_tail_init(head, list);
+    list_splice(&keep, head);
+    to_queue(head)->size -= cnt;
+    positions_reset(to_queue(head));
+    return cnt;
+}
+
+/* Release every element on a list */
+void q_release_list(struct list_head *list)
+{
+    if (!list)
+        return;
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, list) {
+        element_prefetch_walk(safe, list);
+        q_release_element(list_entry(node, element_t, list));
+    }
+    INIT_LIST_HEAD(list);
+}
+
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
-
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each (li, head)
-        len++;
-    return len;
+    return to_queue(head)->size;
 }
 
 /* Delete the middle node in queue */
@@ -118,15 +349,81 @@ bool q_delete_mid(struct list_head *head)
     if (!head || list_empty(head)) {
         return false;
     }
-    struct list_head *first = head->next;
-    struct list_head *last = head->prev;
-    while (first != last && first->next != last) {
-        first = first->next;
-        last = last->prev;
+    queue_t *q = to_queue(head);
+    if (!q->mid)
+        q->mid = node_at(q, q->size / 2);
+
+    struct list_head *mid = q->mid;
+    positions_del(q, q->size / 2);
+    list_del(mid);
+    q_release_element(list_entry(mid, element_t, list));
+    q->size--;
+    return true;
+}
+
+/* Return the element at a position of the queue */
+element_t *q_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return NULL;
+    return list_entry(node_at(to_queue(head), i), element_t, list);
+}
+
+/* Delete the element at a position of the queue */
+bool q_delete_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return false;
+    queue_t *q = to_queue(head);
+    struct list_head *node = node_at(q, i);
+    positions_del(q, i);
+    list_del(node);
+    q_release_element(list_entry(node, element_t, list));
+    q->size--;
+    return true;
+}
+
+/* Insert an element at a position of the queue */
+bool q_insert_at(struct list_head *head, int i, char *s)
+{
+    if (!head || i < 0 || i > to_queue(head)->size)
+        return false;
+    queue_t *q = to_queue(head);
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+    list_add_tail(&e->list, i < q->size ? node_at(q, i) : head);
+    positions_add(q, i, &e->list);
+    q->size++;
+    return true;
+}
+
+/* Delete, in a single pass, every element whose string occurs more than once
+ * in the queue. The deleted elements are only released at the end, so that
+ * the set can still compare against the first copy of each string.
+ */
+static bool delete_dup_hash(queue_t *q)
+{
+    struct dup_set set;
+    if (!dup_set_init(&set, q->size))
+        return false;
+
+    LIST_HEAD(deleted);
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &q->head, list) {
+        struct dup_slot *slot = dup_set_add(&set, e);
+        if (slot->count == 1)
+            continue;
+        list_move_tail(&e->list, &deleted);
+        if (slot->count == 2)
+            list_move_tail(&slot->e->list, &deleted);
+    }
+    dup_set_exit(&set);
+
+    list_for_each_entry_safe (e, safe, &deleted, list) {
+        q_release_element(e);
+        q->size--;
     }
-    list_del(last);
-    free(list_entry(last, element_t, list)->value);
-    free(list_entry(last, element_t, list));
     return true;
 }
 
@@ -136,32 +433,37 @@ bool q_delete_dup(struct list_head *head)
     if (!head || list_empty(head)) {
         return false;
     }
+    positions_reset(to_queue(head));
+    if (q_dedup_hash)
+        return delete_dup_hash(to_queue(head));
     struct list_head *node, *safe;
     bool dup = false;
+    int removed = 0;
     list_for_each_safe (node, safe, head) {
         element_t *cur = list_entry(node, element_t, list);
         if (safe != head) {
             element_t *tmp = list_entry(safe, element_t, list);
-            if (!strcmp(cur->value, tmp->value)) {
+            if (element_equal(cur, tmp)) {
                 list_del(node);
-                free(cur->value);
-                free(cur);
+                q_release_element(cur);
+                removed++;
                 dup = true;
-            } else if (strcmp(cur->value, tmp->value) && dup) {
+            } else if (dup) {
                 list_del(node);
-                free(cur->value);
-                free(cur);
+                q_release_element(cur);
+                removed++;
                 dup = false;
             }
         } else {
             if (dup) {
                 list_del(node);
-                free(cur->value);
-                free(cur);
+                q_release_element(cur);
+                removed++;
                 dup = false;
             }
         }
     }
+    to_queue(head)->size -= removed;
     return true;
 }
 
@@ -171,6 +473,7 @@ void q_swap(struct list_head *head)
     if (!head || list_empty(head) || list_is_singular(head)) {
         return;
     }
+    positions_reset(to_queue(head));
     struct list_head *l1 = head->next;
     struct list_head *l2 = head->next->next;
     while (l1 != head && l2 != head) {
@@ -186,6 +489,11 @@ void q_reverse(struct list_head *head)
     if (!head || list_empty(head) || list_is_singular(head)) {
         return;
     }
+    /* With an even size the middle node ends up right after the middle */
+    queue_t *q = to_queue(head);
+    if (q->mid && !(q->size & 1))
+        q->mid = q->mid->prev;
+    q->indexed = false;
     struct list_head *node = head->next;
     struct list_head *safe = head->next->next;
     while (head != node) {
@@ -203,27 +511,30 @@ void q_reverse(struct list_head *head)
     } */
 void q_reverseK(struct list_head *head, int k)
 {
-    if (!head || list_empty(head) || list_is_singular(head)) {
+    if (!head || list_empty(head) || list_is_singular(head) || k < 2) {
         return;
     }
-    int times = q_size(head) / k;
-    struct list_head *tail;
-
-    LIST_HEAD(tmp);
-    LIST_HEAD(new_head);
-
-    for (int i = 0; i < times; i++) {
-        int j = 0;
-        list_for_each (tail, head) {
-            if (j >= k)
-                break;
-            j++;
+    positions_reset(to_queue(head));
+
+    /* Reverse each full group while walking it, by swapping the links of its
+     * nodes, then reattach its ends to the nodes around it.
+     */
+    struct list_head *before = head, *node = head->next;
+    for (int groups = to_queue(head)->size / k; groups; groups--) {
+        struct list_head *first = node;
+        for (int i = 0; i < k; i++) {
+            struct list_head *next = node->next;
+            node->next = node->prev;
+            node->prev = next;
+            node = next;
         }
-        list_cut_position(&tmp, head, tail->prev);
-        q_reverse(&tmp);
-        list_splice_tail_init(&tmp, &new_head);
+        struct list_head *last = node->prev;
+        before->next = last;
+        last->prev = before;
+        first->next = node;
+        node->prev = first;
+        before = first;
     }
-    list_splice_init(&new_head, head);
 }
 
 struct list_head *merge(struct list_head *l1,
@@ -245,11 +556,14 @@ struct list_head *merge(struct list_head *l1,
         element_t *node1 = list_entry(l1, element_t, list);
         element_t *node2 = list_entry(l2, element_t, list);
 
-        if ((strcmp(node1->value, node2->value) <= 0) ^ descend) {
+        /* Take from l1 on ties, or the sort is not stable */
+        if (!element_before(node2, node1, descend)) {
+            element_prefetch_merge(l1, l2);
             temp->next = l1;
             temp = temp->next;
             l1 = l1->next;
         } else {
+            element_prefetch_merge(l2, l1);
             temp->next = l2;
             temp = temp->next;
             l2 = l2->next;
@@ -290,27 +604,171 @@ struct list_head *mergeSortList(struct list_head *head, bool descend)
     return merge(l1, l2, descend);
 }
 
+typedef int (*list_cmp_func_t)(void *,
+                               const struct list_head *,
+                               const struct list_head *);
 
-void q_sort(struct list_head *head, bool descend)
+int cmp(void *priv, const struct list_head *a, const struct list_head *b);
+void list_sort(void *priv, struct list_head *head, list_cmp_func_t cmp);
+void list_quicksort(struct list_head *head, bool descend);
+
+/* Sort with the algorithm selected by q_sortalgo */
+static void sort_list(struct list_head *head, bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head)) {
+    if (list_empty(head) || list_is_singular(head))
         return;
+
+    switch (q_sortalgo) {
+    case 1: {
+        head->prev->next = NULL;
+        struct list_head *prev = head;
+        struct list_head *node = mergeSortList(head->next, descend);
+        for (; node; node = node->next) {
+            prev->next = node;
+            node->prev = prev;
+            prev = node;
+        }
+        prev->next = head;
+        head->prev = prev;
+        break;
+    }
+    case 2:
+        list_sort(&descend, head, cmp);
+        break;
+    case 3:
+        list_quicksort(head, descend);
+        break;
+    case 4:
+        element_list_natural_sort(head, descend);
+        break;
+    default:
+        element_list_sort(head, descend);
+        break;
     }
+}
 
-    struct list_head *temp = head;
-    head->prev->next = NULL;
-    head->next = mergeSortList(head->next, descend);
+/* Most threads a sort uses */
+#define SORT_MAX_THREADS 64
+
+/* Fewest elements per thread worth starting it for */
+#define SORT_MIN_PER_THREAD 16384
+
+/**
+ * struct sort_task - Work of one thread of a parallel sort
+ * @head: list to sort, or the first of the two lists to merge
+ * @other: list to merge into @head, NULL to sort @head
+ * @descend: order of the sort
+ * @stats: counters updated by the task
+ */
+struct sort_task {
+    struct list_head *head, *other;
+    bool descend;
+    q_stats_t stats;
+};
 
-    struct list_head *curr = head->next;
+static void *sort_task_run(void *arg)
+{
+    struct sort_task *task = arg;
+    q_stats_t saved = q_stats;
+
+    memset(&q_stats, 0, sizeof(q_stats));
+    if (task->other)
+        element_merge_into(task->head, task->other, task->descend);
+    else
+        sort_list(task->head, task->descend);
+    task->stats = q_stats;
+    q_stats = saved;
+    return NULL;
+}
 
-    while (curr->next != NULL) {
-        curr->prev = temp;
-        temp = curr;
-        curr = curr->next;
+/* Run @n tasks at once, the first one on the calling thread, and add their
+ * counters to those of the calling thread.
+ */
+static void sort_tasks_run(struct sort_task *tasks, int n)
+{
+    pthread_t threads[SORT_MAX_THREADS];
+    bool started[SORT_MAX_THREADS] = {false};
+
+    for (int i = 1; i < n; i++)
+        started[i] = !pthread_create(&threads[i], NULL, sort_task_run,
+                                     &tasks[i]);
+    sort_task_run(&tasks[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            sort_task_run(&tasks[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        q_stats.cmps += tasks[i].stats.cmps;
+        q_stats.cmp_reads += tasks[i].stats.cmp_reads;
+    }
+}
+
+/* Cut the @size elements of @head into one segment per thread, sort the
+ * segments concurrently, then merge neighbouring segments pairwise, each
+ * level of the merge tree running its merges concurrently too. Merging only
+ * neighbours, the earlier one first, keeps the sort stable.
+ */
+static void parallel_sort(struct list_head *head,
+                          int size,
+                          int nthreads,
+                          bool descend)
+{
+    struct list_head segs[SORT_MAX_THREADS];
+    struct sort_task tasks[SORT_MAX_THREADS];
+
+    for (int i = 0; i < nthreads; i++) {
+        INIT_LIST_HEAD(&segs[i]);
+        if (i == nthreads - 1) {
+            list_splice_init(head, &segs[i]);
+            break;
+        }
+        struct list_head *node = head;
+        for (int n = size / nthreads; n; n--)
+            node = node->next;
+        list_cut_position(&segs[i], head, node);
+    }
+
+    sigset_t saved;
+    alarm_hold(&saved);
+
+    for (int i = 0; i < nthreads; i++)
+        tasks[i] = (struct sort_task){&segs[i], NULL, descend, {0}};
+    sort_tasks_run(tasks, nthreads);
+
+    for (int step = 1; step < nthreads; step *= 2) {
+        int n = 0;
+        for (int i = 0; i + step < nthreads; i += 2 * step)
+            tasks[n++] =
+                (struct sort_task){&segs[i], &segs[i + step], descend, {0}};
+        sort_tasks_run(tasks, n);
+    }
+
+    list_splice(&segs[0], head);
+    alarm_release(&saved);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head)) {
+        return;
     }
-    curr->prev = temp;
-    curr->next = head;
-    head->prev = curr;
+
+    positions_reset(to_queue(head));
+    int size = to_queue(head)->size;
+    int nthreads = q_sort_threads;
+    if (nthreads > SORT_MAX_THREADS)
+        nthreads = SORT_MAX_THREADS;
+    if (nthreads > size / SORT_MIN_PER_THREAD)
+        nthreads = size / SORT_MIN_PER_THREAD;
+
+    if (nthreads > 1)
+        parallel_sort(head, size, nthreads, descend);
+    else
+        sort_list(head, descend);
 }
 
 /* Remove every node which has a node with a strictly less value anywhere to
@@ -318,27 +776,27 @@ void q_sort(struct list_head *head, bool descend)
 int q_ascend(struct list_head *head)
 {
     if (!head || list_empty(head) || list_is_singular(head)) {
-        return 0;
+        return q_size(head);
     }
+    positions_reset(to_queue(head));
 
 
-    char *tmp_max = list_entry(head->next, element_t, list)->value;
+    element_t *tmp_max = list_entry(head->next, element_t, list);
     struct list_head *cur = head->next->next;
 
 
     while (cur != head) {
         element_t *cur_node = list_entry(cur, element_t, list);
-        char *tmp1 = cur_node->value;
 
-        if (strcmp(tmp1, tmp_max) > 0) {
-            tmp_max = tmp1;
+        if (element_cmp(cur_node, tmp_max) > 0) {
+            tmp_max = cur_node;
             cur = cur->next;
         } else {
             cur = cur->next;
             element_t *free_node = list_entry(cur->prev, element_t, list);
             list_del(&free_node->list);
-            free(free_node->value);
-            free(free_node);
+            q_release_element(free_node);
+            to_queue(head)->size--;
         }
     }
 
@@ -350,64 +808,53 @@ int q_ascend(struct list_head *head)
 int q_descend(struct list_head *head)
 {
     if (!head || list_empty(head) || list_is_singular(head)) {
-        return 0;
+        return q_size(head);
     }
+    positions_reset(to_queue(head));
 
 
-    char *tmp_max = list_entry(head->prev, element_t, list)->value;
+    element_t *tmp_max = list_entry(head->prev, element_t, list);
     struct list_head *cur = head->prev->prev;
 
 
     while (cur != head) {
         element_t *cur_node = list_entry(cur, element_t, list);
-        char *tmp1 = cur_node->value;
 
-        if (strcmp(tmp1, tmp_max) > 0) {
-            tmp_max = tmp1;
+        if (element_cmp(cur_node, tmp_max) > 0) {
+            tmp_max = cur_node;
             cur = cur->prev;
         } else {
             cur = cur->prev;
             element_t *free_node = list_entry(cur->next, element_t, list);
             list_del(&free_node->list);
-            free(free_node->value);
-            free(free_node);
+            q_release_element(free_node);
+            to_queue(head)->size--;
         }
     }
 
     return q_size(head);
 }
+/* Move the size of the queue @q, merged into the queue @into, over to it */
+static void merge_take(struct list_head *q, struct list_head *into)
+{
+    to_queue(into)->size += to_queue(q)->size;
+    to_queue(q)->size = 0;
+    positions_reset(to_queue(into));
+    positions_reset(to_queue(q));
+}
+
 /* Merge all the queues into one sorted queue, which is in ascending/descending
  * order */
 int q_merge(struct list_head *head, bool descend)
 {
     if (!head || list_empty(head))
         return 0;
-    else if (list_is_singular(head))
-        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
-
-    queue_contex_t *node = list_entry(head->next, queue_contex_t, chain);
-    node->q->prev->next = NULL;
-    struct list_head *temp = node->chain.next;
-    for (int i = 0; i < ((node->size) - 1); i++) {
-        queue_contex_t *next_node = list_entry(temp, queue_contex_t, chain);
-        next_node->q->prev->next = NULL;
-        node->q->next = merge(node->q->next, next_node->q->next, descend);
-        INIT_LIST_HEAD(next_node->q);
-        temp = temp->next;
-    }
-
-    struct list_head *curr = node->q->next;
-    struct list_head *pre = node->q;
-    while (curr->next != NULL) {
-        curr->prev = pre;
-        pre = curr;
-        curr = curr->next;
-    }
-    curr->prev = pre;
-    curr->next = node->q;
-    node->q->prev = curr;
 
-    return q_size(node->q);
+    queue_contex_t *ctx = list_first_entry(head, queue_contex_t, chain);
+    queue_t *first = to_queue(ctx->q);
+    positions_reset(first);
+    element_merge_chain(head, descend, q_merge_threads, merge_take);
+    return first->size;
 }
 
 /* linux list_sort
@@ -421,11 +868,6 @@ int q_merge(struct list_head *head, bool descend)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #endif
 
-
-typedef int (*list_cmp_func_t)(void *,
-                               const struct list_head *,
-                               const struct list_head *);
-
 static struct list_head *list_merge(void *priv,
                                     list_cmp_func_t cmp,
                                     struct list_head *a,
@@ -437,22 +879,15 @@ static void merge_final(void *priv,
                         struct list_head *l1,
                         struct list_head *l2);
 
-
+/* Compare two elements for list_sort(), @priv points to the descend flag */
 int cmp(void *priv, const struct list_head *a, const struct list_head *b)
 {
-    element_t *node_a = container_of(a, element_t, list);
-    element_t *node_b = container_of(b, element_t, list);
+    const element_t *ea = container_of(a, element_t, list);
+    const element_t *eb = container_of(b, element_t, list);
 
-    if (node_a->value < node_b->value)
-        return -1;
-    else if (node_a->value > node_b->value)
-        return 1;
-    else
-        return 0;
+    return *(const bool *) priv ? element_cmp(eb, ea) : element_cmp(ea, eb);
 }
 
-
-
 void list_sort(void *priv, struct list_head *head, list_cmp_func_t cmp)
 {
     struct list_head *list = head->next, *pending = NULL;
@@ -587,75 +1022,73 @@ static void merge_final(void *priv,
 }
 
 
-/* Implement the  Fisher–Yates shuffle algo*/
-static void swap(struct list_head *a, struct list_head *b)
+/* Shuffle the queue uniformly at random */
+bool q_shuffle(struct list_head *head, uint64_t seed)
 {
-    element_t *a_entry = list_entry(a, element_t, list);
-    element_t *b_entry = list_entry(b, element_t, list);
-    char *tmp = b_entry->value;
-    b_entry->value = a_entry->value;
-    a_entry->value = tmp;
+    if (!head)
+        return false;
+    positions_reset(to_queue(head));
+    return element_list_shuffle(head, to_queue(head)->size, seed);
 }
 
-void q_shuffle(struct list_head *head)
+/* Implement the list_quicksort
+ * The pivot is the middle element, so that sorted and reversed input split
+ * evenly, and the three-way partition takes runs of equal strings out at
+ * once. Other input may still split badly and take quadratic time, but only
+ * the smaller partition is sorted recursively while the larger one is sorted
+ * by the next iteration, which bounds the recursion depth to log n. Moving
+ * the elements in order into the partitions makes the sort stable.
+ */
+void list_quicksort(struct list_head *head, bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
+    /* Sorted elements going before, and after, those left in @head */
+    LIST_HEAD(before);
+    LIST_HEAD(after);
+
+    while (!list_empty(head) && !list_is_singular(head)) {
+        struct list_head list_less, list_equal, list_greater;
+        struct list_head *fwd = head->next, *bwd = head->prev;
+        element_t *item = NULL, *is = NULL;
+        int n_less = 0, n_greater = 0;
+
+        while (fwd != bwd && fwd->next != bwd) {
+            fwd = fwd->next;
+            bwd = bwd->prev;
+        }
+        const element_t *pivot = list_entry(fwd, element_t, list);
+
+        INIT_LIST_HEAD(&list_less);
+        INIT_LIST_HEAD(&list_equal);
+        INIT_LIST_HEAD(&list_greater);
+
+        list_for_each_entry_safe (item, is, head, list) {
+            int ret = element_cmp(item, pivot);
+            if (descend)
+                ret = -ret;
+            if (ret < 0) {
+                list_move_tail(&item->list, &list_less);
+                n_less++;
+            } else if (ret > 0) {
+                list_move_tail(&item->list, &list_greater);
+                n_greater++;
+            } else {
+                list_move_tail(&item->list, &list_equal);
+            }
+        }
 
-    int size = q_size(head);
-    struct list_head *new = head->prev;
-    for (int i = size - 1; i > 0; i--) {
-        struct list_head *old = head->next;
-        int r = rand() % (i + 1);
-        while (r > 0) {
-            old = old->next;
-            r--;
+        if (n_less <= n_greater) {
+            list_quicksort(&list_less, descend);
+            list_splice_tail(&list_less, &before);
+            list_splice_tail(&list_equal, &before);
+            list_splice(&list_greater, head);
+        } else {
+            list_quicksort(&list_greater, descend);
+            list_splice(&list_greater, &after);
+            list_splice(&list_equal, &after);
+            list_splice(&list_less, head);
         }
-        swap(old, new);
-        new = new->prev;
     }
-}
-
-/* Implement the list_quicksort*/
-struct listitem {
-    uint16_t i;
-    struct list_head list;
-};
 
-static inline int cmpint(const void *p1, const void *p2)
-{
-    const uint16_t *i1 = (const uint16_t *) p1;
-    const uint16_t *i2 = (const uint16_t *) p2;
-
-    return *i1 - *i2;
+    list_splice(&before, head);
+    list_splice_tail(&after, head);
 }
-
-void list_quicksort(struct list_head *head)
-{
-    struct list_head list_less, list_greater;
-    struct listitem *pivot;
-    struct listitem *item = NULL, *is = NULL;
-
-    if (list_empty(head) || list_is_singular(head))
-        return;
-
-    INIT_LIST_HEAD(&list_less);
-    INIT_LIST_HEAD(&list_greater);
-
-    pivot = list_first_entry(head, struct listitem, list);
-    list_del(&pivot->list);
-
-    list_for_each_entry_safe (item, is, head, list) {
-        if (cmpint(&item->i, &pivot->i) < 0)
-            list_move_tail(&item->list, &list_less);
-        else
-            list_move_tail(&item->list, &list_greater);
-    }
-
-    list_quicksort(&list_less);
-    list_quicksort(&list_greater);
-
-    list_add(&pivot->list, head);
-    list_splice(&list_less, head);
-    list_splice_tail(&list_greater, head);
-}
\ No newline at end of file
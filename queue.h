@@ -9,20 +9,46 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Strings shorter than this many bytes (including the terminating null
+ * character) are stored inside the element itself.
+ */
+#define ELEMENT_INLINE_SIZE 16
+
+struct slab;
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @prefix: first 8 bytes of the string, zero padded and loaded big-endian
+ * @slab: allocator the element was obtained from, NULL for malloc
+ * @len: length of the string, excluding the terminating null character
+ * @interned: @value points to a string shared through the interning pool
+ * @data: inline storage for short strings
+ *
+ * @value points to @data when the string fits in ELEMENT_INLINE_SIZE bytes.
+ * A longer string follows the element in the same allocation, unless the
+ * element comes from a slab, whose elements all have the same size, and then
+ * @value points to a separately allocated copy. When interning is enabled, it
+ * points to a reference counted copy shared with other elements instead.
+ * Either way the element must be released with q_release_element().
+ *
+ * Comparing two @prefix values as integers orders them like strcmp() orders
+ * the strings, so most comparisons never have to read @value.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t prefix;
+    struct slab *slab;
+    uint32_t len;
+    bool interned;
+    char data[ELEMENT_INLINE_SIZE];
 } element_t;
 
 /**
@@ -39,6 +65,76 @@ typedef struct {
     int id;
 } queue_contex_t;
 
+/* Tunables */
+
+/* When nonzero, q_new() creates queues whose elements come from a slab owned
+ * by the queue instead of from malloc.
+ */
+extern int q_use_slab;
+
+/* When nonzero, equal strings too long to be stored inline share one reference
+ * counted copy instead of each element allocating its own.
+ */
+extern int q_intern;
+
+/* When nonzero (default), string comparisons look at the cached prefixes and
+ * only read the strings when the prefixes are equal.
+ */
+extern int q_cmp_prefix;
+
+/* When nonzero, the strings are compared by an inline kernel that checks 16
+ * bytes per step, or 32 when built with AVX2, rather than by memcmp(). It is
+ * off by default: the C library already picks a vectorized memcmp() for the
+ * processor it runs on, which cmpbench measures as fast or faster.
+ */
+extern int q_cmp_simd;
+
+/* Sorting algorithm used by q_sort() of the list backend (the others ignore
+ * it): 0 bottom-up merge sort (default), 1 recursive top-down merge sort,
+ * 2 Linux kernel list_sort, 3 quicksort, 4 natural merge sort.
+ */
+extern int q_sortalgo;
+
+/* Number of threads q_sort() of the list backend may use on large queues */
+extern int q_sort_threads;
+
+/* When nonzero, q_delete_dup() deletes every string that occurs more than once
+ * anywhere in the queue, finding the copies with a hash set, instead of only
+ * adjacent duplicates.
+ */
+extern int q_dedup_hash;
+
+/* Number of threads q_merge() merges pairs of queues on, 1 (default) for a
+ * single k-way merge.
+ */
+extern int q_merge_threads;
+
+/* When nonzero (default), the walks along long lists of elements, such as
+ * merging and freeing them, start loading the elements they reach next before
+ * they get there.
+ */
+extern int q_prefetch;
+
+/* When nonzero, the queues of the list backend find the elements by position,
+ * for q_at(), q_delete_at(), q_insert_at() and q_delete_mid(), through an
+ * order statistic index in O(log n) instead of walking to them. The index is
+ * built on demand, kept up to date by the insertions and removals of single
+ * elements, and built again after the operations moving elements around.
+ */
+extern int q_index;
+
+/**
+ * q_stats_t - Counters updated by the queue operations, one set per thread
+ * @cmps: number of string comparisons
+ * @cmp_reads: comparisons that had to read the strings themselves
+ */
+typedef struct {
+    uint64_t cmps;
+    uint64_t cmp_reads;
+} q_stats_t;
+
+extern _Thread_local q_stats_t q_stats;
+
 /* Operations on queue */
 
 /**
@@ -51,6 +147,9 @@ struct list_head *q_new();
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
+ *
+ * Elements allocated from the slab of the queue are released chunk by chunk
+ * instead of one at a time.
  */
 void q_free(struct list_head *head);
 
@@ -78,6 +177,31 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert n copies of a string in the head
+ * @head: header of queue
+ * @s: string would be inserted
+ * @n: number of copies
+ *
+ * The elements come from the slab of the queue, reserved for all of them at
+ * once, or from a block allocated for them alone if it has none, and are
+ * linked into the queue with a single splice. If not all of them can be allocated, the ones that could are
+ * still inserted.
+ *
+ * Return: the number of elements inserted, 0 if queue is NULL
+ */
+int q_insert_head_bulk(struct list_head *head, char *s, int n);
+
+/**
+ * q_insert_tail_bulk() - Insert n copies of a string at the tail
+ * @head: header of queue
+ * @s: string would be inserted
+ * @n: number of copies
+ *
+ * Return: the number of elements inserted, 0 if queue is NULL
+ */
+int q_insert_tail_bulk(struct list_head *head, char *s, int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,22 +232,69 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_head_n() - Remove up to n elements from head of queue
+ * @head: header of queue
+ * @list: list the removed elements are appended to, in queue order
+ * @n: maximum number of elements to remove
+ * @sp: array of n output buffers of @bufsize bytes each, or NULL
+ * @bufsize: size of each output buffer
+ *
+ * The removed elements are cut off the queue as a single run and handed over
+ * on @list, e.g. to be released at once with q_release_list(). If sp is
+ * non-NULL, the i-th removed string is copied to sp + i * bufsize as
+ * q_remove_head() would do.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize);
+
+/**
+ * q_remove_tail_n() - Remove up to n elements from tail of queue
+ * @head: header of queue
+ * @list: list the removed elements are appended to, in queue order
+ * @n: maximum number of elements to remove
+ * @sp: array of n output buffers of @bufsize bytes each, or NULL
+ * @bufsize: size of each output buffer
+ *
+ * The strings are copied in removal order, i.e. the last element of the queue
+ * goes to the first buffer.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_tail_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
  * This function is intended for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
+
+/**
+ * q_release_list() - Release every element on a list
+ * @list: list of elements, e.g. filled by q_remove_head_n()
+ *
+ * @list is empty afterwards.
+ */
+void q_release_list(struct list_head *list);
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The count is maintained by every operation on the queue, so this takes
+ * constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -143,6 +314,41 @@ int q_size(struct list_head *head);
  */
 bool q_delete_mid(struct list_head *head);
 
+/**
+ * q_at() - Find the element at a position in queue
+ * @head: header of queue
+ * @i: position of the element, counting from 0 at the head
+ *
+ * Return: the element, NULL if queue is NULL or @i is out of range
+ */
+element_t *q_at(struct list_head *head, int i);
+
+/**
+ * q_delete_at() - Delete the element at a position in queue
+ * @head: header of queue
+ * @i: position of the element, counting from 0 at the head
+ *
+ * The element is removed and released, like q_delete_mid() does with the
+ * middle one.
+ *
+ * Return: true for success, false if queue is NULL or @i is out of range.
+ */
+bool q_delete_at(struct list_head *head, int i);
+
+/**
+ * q_insert_at() - Insert an element at a position in queue
+ * @head: header of queue
+ * @i: position of the new element, from 0 to the size of the queue
+ * @s: string would be inserted
+ *
+ * The elements from position @i on move back by one. Argument s points to the
+ * string to be stored, which is copied like q_insert_head() does.
+ *
+ * Return: true for success, false if queue is NULL, @i is out of range or
+ * memory allocation failed.
+ */
+bool q_insert_at(struct list_head *head, int i, char *s);
+
 /**
  * q_delete_dup() - Delete all nodes that have duplicate string,
  *                  leaving only distinct strings from the original queue.
@@ -151,7 +357,8 @@ bool q_delete_mid(struct list_head *head);
  * Reference:
  * https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
  *
- * Return: true for success, false if list is NULL or empty.
+ * Return: true for success, false if list is NULL or empty, or if the hash
+ * set of q_dedup_hash could not be allocated.
  */
 bool q_delete_dup(struct list_head *head);
 
@@ -200,6 +407,16 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/**
+ * q_shuffle() - Shuffle the elements of queue uniformly at random
+ * @head: header of queue
+ * @seed: seed of the random number generator, the same seed giving the same
+ *        order for the same queue
+ *
+ * Return: true for success, false if list is NULL or if memory ran out.
+ */
+bool q_shuffle(struct list_head *head, uint64_t seed);
+
 /**
  * q_ascend() - Delete every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -0,0 +1,839 @@
+#include "queue.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "element.h"
+
+/* Unrolled implementation of the queue, selected with "make QUEUE=chunk".
+ *
+ * Besides the doubly-linked list of elements, which is part of the interface
+ * and walked by the callers, each queue keeps pointers to its elements, in
+ * queue order, in a doubly-linked list of fixed-size chunks. Operations that
+ * visit many elements scan these arrays, where the address of the next element
+ * is known without loading the current one, and operations that reorder the
+ * queue permute the pointers and then relink the elements in a single pass.
+ */
+
+/* 64 pointers and the chunk header add up to a little more than 8 cache
+ * lines.
+ */
+#define CHUNK_SLOTS 64
+
+/**
+ * struct chunk - Run of consecutive elements of a queue
+ * @link: node in the list of chunks of the queue
+ * @start: index of the first used slot
+ * @end: index past the last used slot
+ * @slots: pointers to the elements
+ *
+ * Only the slots in [@start, @end) are used. A chunk in the list of a queue
+ * is never empty.
+ */
+struct chunk {
+    struct list_head link;
+    int start, end;
+    element_t *slots[CHUNK_SLOTS];
+};
+
+/**
+ * queue_t - Header of a queue
+ * @head: list head handed out to the callers, must be the first member
+ * @size: number of elements in the queue
+ * @slab: element allocator of this queue, NULL to use malloc
+ * @chunks: the chunks holding the elements, in queue order
+ * @spare: empty chunks kept for reuse
+ *
+ * @spare holds at most one chunk, except after operations that may not free
+ * memory, such as q_merge(), left more behind.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct slab *slab;
+    struct list_head chunks;
+    struct list_head spare;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+#define chunk_entry(node) list_entry(node, struct chunk, link)
+
+static inline struct chunk *first_chunk(queue_t *q)
+{
+    return list_empty(&q->chunks) ? NULL : chunk_entry(q->chunks.next);
+}
+
+static inline struct chunk *last_chunk(queue_t *q)
+{
+    return list_empty(&q->chunks) ? NULL : chunk_entry(q->chunks.prev);
+}
+
+static inline int chunk_count(const struct chunk *c)
+{
+    return c->end - c->start;
+}
+
+/* Take an empty chunk whose used slots start at @start */
+static struct chunk *chunk_get(queue_t *q, int start)
+{
+    struct chunk *c;
+    if (!list_empty(&q->spare)) {
+        c = chunk_entry(q->spare.next);
+        list_del(&c->link);
+    } else {
+        c = malloc(sizeof(struct chunk));
+        if (!c)
+            return NULL;
+    }
+    c->start = c->end = start;
+    return c;
+}
+
+/* Remove the empty chunk @c from the queue, keeping it if there is no spare */
+static void chunk_put(queue_t *q, struct chunk *c)
+{
+    list_del(&c->link);
+    if (list_empty(&q->spare))
+        list_add(&c->link, &q->spare);
+    else
+        free(c);
+}
+
+static bool push_front(queue_t *q, element_t *e)
+{
+    struct chunk *c = first_chunk(q);
+    if (!c || !c->start) {
+        c = chunk_get(q, CHUNK_SLOTS);
+        if (!c)
+            return false;
+        list_add(&c->link, &q->chunks);
+    }
+    c->slots[--c->start] = e;
+    return true;
+}
+
+static bool push_back(queue_t *q, element_t *e)
+{
+    struct chunk *c = last_chunk(q);
+    if (!c || c->end == CHUNK_SLOTS) {
+        c = chunk_get(q, 0);
+        if (!c)
+            return false;
+        list_add_tail(&c->link, &q->chunks);
+    }
+    c->slots[c->end++] = e;
+    return true;
+}
+
+static element_t *pop_front(queue_t *q)
+{
+    struct chunk *c = first_chunk(q);
+    element_t *e = c->slots[c->start++];
+    if (c->start == c->end)
+        chunk_put(q, c);
+    return e;
+}
+
+static element_t *pop_back(queue_t *q)
+{
+    struct chunk *c = last_chunk(q);
+    element_t *e = c->slots[--c->end];
+    if (c->start == c->end)
+        chunk_put(q, c);
+    return e;
+}
+
+/* Position of an element in the chunks of a queue */
+struct cursor {
+    struct chunk *c;
+    int i;
+};
+
+static inline void cursor_next(struct cursor *cur)
+{
+    if (++cur->i == cur->c->end) {
+        cur->c = chunk_entry(cur->c->link.next);
+        cur->i = cur->c->start;
+    }
+}
+
+static inline void cursor_prev(struct cursor *cur)
+{
+    if (cur->i-- == cur->c->start) {
+        cur->c = chunk_entry(cur->c->link.prev);
+        cur->i = cur->c->end - 1;
+    }
+}
+
+static inline element_t **cursor_slot(const struct cursor *cur)
+{
+    return &cur->c->slots[cur->i];
+}
+
+static inline void swap_slots(element_t **a, element_t **b)
+{
+    element_t *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Rebuild the list of elements from the order of the chunks */
+static void relink(queue_t *q)
+{
+    struct list_head *prev = &q->head;
+    struct chunk *c;
+    list_for_each_entry (c, &q->chunks, link) {
+        for (int i = c->start; i < c->end; i++) {
+            struct list_head *node = &c->slots[i]->list;
+            prev->next = node;
+            node->prev = prev;
+            prev = node;
+        }
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+}
+
+/* Store the null-terminated list of elements starting at @node in the chunks
+ * of @q, keeping the number of elements of each chunk.
+ */
+static void refill(queue_t *q, struct list_head *node)
+{
+    struct chunk *c;
+    list_for_each_entry (c, &q->chunks, link) {
+        for (int i = c->start; i < c->end; i++) {
+            c->slots[i] = list_entry(node, element_t, list);
+            node = node->next;
+        }
+    }
+}
+
+/* Merge neighboring chunks whose elements fit in one of them */
+static void pack(queue_t *q)
+{
+    struct chunk *c = first_chunk(q);
+    if (!c)
+        return;
+    while (c->link.next != &q->chunks) {
+        struct chunk *next = chunk_entry(c->link.next);
+        int cnt = chunk_count(c), next_cnt = chunk_count(next);
+        if (cnt + next_cnt > CHUNK_SLOTS) {
+            c = next;
+            continue;
+        }
+        memmove(c->slots, c->slots + c->start, cnt * sizeof(element_t *));
+        memcpy(c->slots + cnt, next->slots + next->start,
+               next_cnt * sizeof(element_t *));
+        c->start = 0;
+        c->end = cnt + next_cnt;
+        next->start = next->end;
+        chunk_put(q, next);
+    }
+}
+
+/* Decide whether @e goes away, given @next, the element visited after it */
+typedef bool (*drop_func_t)(element_t *e, element_t *next, void *priv);
+
+/* Visit the elements from the head or from the tail and release those @drop
+ * asks for, compacting each chunk in place. Return the number of elements
+ * released.
+ */
+static int filter(queue_t *q, bool from_tail, drop_func_t drop, void *priv)
+{
+    int removed = 0;
+    struct list_head *node = from_tail ? q->chunks.prev : q->chunks.next;
+    while (node != &q->chunks) {
+        struct chunk *c = chunk_entry(node);
+        struct list_head *following = from_tail ? node->prev : node->next;
+        element_t *next_first = NULL;
+        if (following != &q->chunks) {
+            struct chunk *f = chunk_entry(following);
+            next_first = f->slots[from_tail ? f->end - 1 : f->start];
+        }
+        int cnt = chunk_count(c);
+        int w = from_tail ? c->end : c->start;
+        for (int j = 0; j < cnt; j++) {
+            int r = from_tail ? c->end - 1 - j : c->start + j;
+            element_t *e = c->slots[r];
+            element_t *next;
+            if (j + 1 < cnt)
+                next = c->slots[from_tail ? r - 1 : r + 1];
+            else
+                next = next_first;
+            if (drop(e, next, priv)) {
+                list_del(&e->list);
+                q_release_element(e);
+                removed++;
+            } else if (from_tail) {
+                c->slots[--w] = e;
+            } else {
+                c->slots[w++] = e;
+            }
+        }
+        if (from_tail)
+            c->start = w;
+        else
+            c->end = w;
+        if (!chunk_count(c))
+            chunk_put(q, c);
+        node = following;
+    }
+    q->size -= removed;
+    pack(q);
+    return removed;
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+    q->size = 0;
+    q->slab = NULL;
+    if (q_use_slab) {
+        q->slab = slab_new();
+        if (!q->slab) {
+            free(q);
+            return NULL;
+        }
+    }
+    INIT_LIST_HEAD(&q->head);
+    INIT_LIST_HEAD(&q->chunks);
+    INIT_LIST_HEAD(&q->spare);
+    return &q->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+    queue_t *q = to_queue(head);
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, &q->chunks) {
+        struct chunk *c = chunk_entry(node);
+        for (int i = c->start; i < c->end; i++) {
+            if (i + PREFETCH_DISTANCE < c->end)
+                element_prefetch_whole(c->slots[i + PREFETCH_DISTANCE]);
+            if (i + PREFETCH_DISTANCE / 2 < c->end)
+                element_prefetch_value(c->slots[i + PREFETCH_DISTANCE / 2]);
+            element_discard(c->slots[i], q->slab);
+        }
+        free(c);
+    }
+    list_for_each_safe (node, safe, &q->spare)
+        free(chunk_entry(node));
+    if (q->slab)
+        slab_orphan(q->slab);
+    free(q);
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+    if (!push_front(q, e)) {
+        q_release_element(e);
+        return false;
+    }
+    list_add(&e->list, head);
+    q->size++;
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+    if (!push_back(q, e)) {
+        q_release_element(e);
+        return false;
+    }
+    list_add_tail(&e->list, head);
+    q->size++;
+    return true;
+}
+
+/* Insert @n copies of @s at the head or at the tail, carving the elements out
+ * of the slab of the queue if it owns one, or else of a block for this batch
+ * only.
+ */
+static int insert_bulk(struct list_head *head, const char *s, int n, bool tail)
+{
+    if (!head || n < 1)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    struct slab *slab = slab_batch_begin(q->slab, n);
+
+    size_t len = strlen(s) + 1;
+    int cnt = 0;
+    while (cnt < n) {
+        element_t *e = element_new(slab, s, len);
+        if (!e)
+            break;
+        if (!(tail ? push_back(q, e) : push_front(q, e))) {
+            q_release_element(e);
+            break;
+        }
+        if (tail)
+            list_add_tail(&e->list, head);
+        else
+            list_add(&e->list, head);
+        cnt++;
+    }
+    slab_batch_end(q->slab, slab);
+    q->size += cnt;
+    return cnt;
+}
+
+/* Insert n copies of a string at head of queue */
+int q_insert_head_bulk(struct list_head *head, char *s, int n)
+{
+    return insert_bulk(head, s, n, false);
+}
+
+/* Insert n copies of a string at tail of queue */
+int q_insert_tail_bulk(struct list_head *head, char *s, int n)
+{
+    return insert_bulk(head, s, n, true);
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    queue_t *q = to_queue(head);
+    element_t *e = pop_front(q);
+    element_copy(sp, e, bufsize);
+    list_del(&e->list);
+    q->size--;
+    return e;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    queue_t *q = to_queue(head);
+    element_t *e = pop_back(q);
+    element_copy(sp, e, bufsize);
+    list_del(&e->list);
+    q->size--;
+    return e;
+}
+
+/* Remove up to n elements from head of queue */
+int q_remove_head_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize)
+{
+    if (!head || list_empty(head) || n < 1)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    int cnt = 0;
+    while (cnt < n && q->size) {
+        element_t *e = pop_front(q);
+        if (sp)
+            element_copy(sp + cnt * bufsize, e, bufsize);
+        list_move_tail(&e->list, list);
+        q->size--;
+        cnt++;
+    }
+    return cnt;
+}
+
+/* Remove up to n elements from tail of queue */
+int q_remove_tail_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize)
+{
+    if (!head || list_empty(head) || n < 1)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    LIST_HEAD(run);
+    int cnt = 0;
+    while (cnt < n && q->size) {
+        element_t *e = pop_back(q);
+        if (sp)
+            element_copy(sp + cnt * bufsize, e, bufsize);
+        list_move(&e->list, &run);
+        q->size--;
+        cnt++;
+    }
+    list_splice_tail(&run, list);
+    return cnt;
+}
+
+/* Release every element on a list */
+void q_release_list(struct list_head *list)
+{
+    if (!list)
+        return;
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, list) {
+        element_prefetch_walk(safe, list);
+        q_release_element(list_entry(node, element_t, list));
+    }
+    INIT_LIST_HEAD(list);
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+    return to_queue(head)->size;
+}
+
+/* Return the chunk holding the element at index @i, walking the chunks from
+ * the nearer end, and set *@off to the offset of the element in it.
+ */
+static struct chunk *find(queue_t *q, int i, int *off)
+{
+    struct chunk *c;
+    if (i < q->size / 2) {
+        for (c = first_chunk(q); i >= chunk_count(c);
+             c = chunk_entry(c->link.next))
+            i -= chunk_count(c);
+        *off = i;
+    } else {
+        i = q->size - 1 - i;
+        for (c = last_chunk(q); i >= chunk_count(c);
+             c = chunk_entry(c->link.prev))
+            i -= chunk_count(c);
+        *off = chunk_count(c) - 1 - i;
+    }
+    return c;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    /* The middle node is the ((size / 2) + 1)th one, counting from 1 */
+    return q_delete_at(head, q_size(head) / 2);
+}
+
+/* Return the element at a position of the queue */
+element_t *q_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return NULL;
+    int off;
+    struct chunk *c = find(to_queue(head), i, &off);
+    return c->slots[c->start + off];
+}
+
+/* Delete the element at a position of the queue */
+bool q_delete_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return false;
+
+    queue_t *q = to_queue(head);
+    int idx;
+    struct chunk *c = find(q, i, &idx);
+
+    /* Close the gap from whichever side of the chunk is shorter */
+    i = c->start + idx;
+    element_t *e = c->slots[i];
+    if (idx < chunk_count(c) / 2) {
+        memmove(c->slots + c->start + 1, c->slots + c->start,
+                idx * sizeof(element_t *));
+        c->start++;
+    } else {
+        memmove(c->slots + i, c->slots + i + 1,
+                (c->end - i - 1) * sizeof(element_t *));
+        c->end--;
+    }
+    if (!chunk_count(c))
+        chunk_put(q, c);
+
+    list_del(&e->list);
+    q_release_element(e);
+    q->size--;
+    return true;
+}
+
+/* Insert an element at a position of the queue */
+bool q_insert_at(struct list_head *head, int i, char *s)
+{
+    if (!head || i < 0 || i > to_queue(head)->size)
+        return false;
+    if (!i)
+        return q_insert_head(head, s);
+    if (i == to_queue(head)->size)
+        return q_insert_tail(head, s);
+
+    queue_t *q = to_queue(head);
+    int idx;
+    struct chunk *c = find(q, i, &idx);
+    if (c->start == 0 && c->end == CHUNK_SLOTS) {
+        /* Split the full chunk, moving its upper half to a new one */
+        struct chunk *next = chunk_get(q, 0);
+        if (!next)
+            return false;
+        next->end = CHUNK_SLOTS / 2;
+        memcpy(next->slots, c->slots + CHUNK_SLOTS / 2,
+               CHUNK_SLOTS / 2 * sizeof(element_t *));
+        c->end = CHUNK_SLOTS / 2;
+        list_add(&next->link, &c->link);
+        if (idx >= CHUNK_SLOTS / 2) {
+            c = next;
+            idx -= CHUNK_SLOTS / 2;
+        }
+    }
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+
+    /* The element at @idx and those after it move back by one slot, or those
+     * before it move forward, whichever way there is room and less to move.
+     */
+    list_add_tail(&e->list, &c->slots[c->start + idx]->list);
+    if (c->end < CHUNK_SLOTS && (!c->start || idx >= chunk_count(c) / 2)) {
+        memmove(c->slots + c->start + idx + 1, c->slots + c->start + idx,
+                (chunk_count(c) - idx) * sizeof(element_t *));
+        c->end++;
+    } else {
+        memmove(c->slots + c->start - 1, c->slots + c->start,
+                idx * sizeof(element_t *));
+        c->start--;
+    }
+    c->slots[c->start + idx] = e;
+    q->size++;
+    return true;
+}
+
+static bool drop_dup(element_t *e, element_t *next, void *priv)
+{
+    /* Whether @e equals the element visited before it */
+    bool *dup = priv;
+    bool drop = *dup;
+    *dup = next && element_equal(e, next);
+    return drop || *dup;
+}
+
+static bool drop_repeated(element_t *e, element_t *next, void *priv)
+{
+    /* Whether the string of @e occurs more than once in the queue */
+    return dup_set_find(priv, e)->count > 1;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return false;
+
+    /* Count the copies of each string, then drop those of the strings seen
+     * more than once. Going from the tail, the first copy, which the set
+     * compares against, is the last one released.
+     */
+    if (q_dedup_hash) {
+        struct dup_set set;
+        if (!dup_set_init(&set, to_queue(head)->size))
+            return false;
+        element_t *e;
+        list_for_each_entry (e, head, list)
+            dup_set_add(&set, e);
+        filter(to_queue(head), true, drop_repeated, &set);
+        dup_set_exit(&set);
+        return true;
+    }
+
+    bool dup = false;
+    filter(to_queue(head), false, drop_dup, &dup);
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    struct cursor cur = {first_chunk(q), first_chunk(q)->start};
+    for (int pairs = q->size / 2; pairs; pairs--) {
+        element_t **a = cursor_slot(&cur);
+        cursor_next(&cur);
+        swap_slots(a, cursor_slot(&cur));
+        if (pairs > 1)
+            cursor_next(&cur);
+    }
+    relink(q);
+}
+
+/* Reverse a circular doubly-linked list in place */
+static void list_reverse(struct list_head *head)
+{
+    struct list_head *node = head;
+    do {
+        struct list_head *next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != head);
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    list_reverse(head);
+    list_reverse(&q->chunks);
+    struct chunk *c;
+    list_for_each_entry (c, &q->chunks, link) {
+        for (int i = c->start, j = c->end - 1; i < j; i++, j--)
+            swap_slots(&c->slots[i], &c->slots[j]);
+    }
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || list_empty(head) || list_is_singular(head) || k < 2)
+        return;
+
+    queue_t *q = to_queue(head);
+    struct cursor cur = {first_chunk(q), first_chunk(q)->start};
+    for (int groups = q->size / k; groups; groups--) {
+        struct cursor front = cur, back = cur;
+        for (int i = 1; i < k; i++)
+            cursor_next(&back);
+        cur = back;
+        for (int i = 0; i < k / 2; i++) {
+            swap_slots(cursor_slot(&front), cursor_slot(&back));
+            cursor_next(&front);
+            cursor_prev(&back);
+        }
+        if (groups > 1)
+            cursor_next(&cur);
+    }
+    relink(q);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    /* Sort every chunk on its own, then merge the chunks as runs linked
+     * through the elements.
+     */
+    queue_t *q = to_queue(head);
+    struct list_head *pending[MERGE_PENDING] = {NULL};
+    struct chunk *c;
+    list_for_each_entry (c, &q->chunks, link) {
+        element_sort_slots(c->slots + c->start, chunk_count(c), descend);
+        for (int i = c->start; i < c->end; i++)
+            c->slots[i]->list.next =
+                i + 1 < c->end ? &c->slots[i + 1]->list : NULL;
+        merge_add_run(pending, &c->slots[c->start]->list, descend);
+    }
+    struct list_head *sorted = merge_pending(pending, descend);
+    refill(q, sorted);
+    relink(q);
+}
+
+/* Shuffle the queue uniformly at random */
+bool q_shuffle(struct list_head *head, uint64_t seed)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!element_list_shuffle(head, q->size, seed))
+        return false;
+    refill(q, head->next);
+    return true;
+}
+
+static bool drop_not_above(element_t *e, element_t *next, void *priv)
+{
+    element_t **max = priv;
+    if (!*max || element_cmp(e, *max) > 0) {
+        *max = e;
+        return false;
+    }
+    return true;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(head);
+    element_t *max = NULL;
+    filter(to_queue(head), false, drop_not_above, &max);
+    return q_size(head);
+}
+
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it */
+int q_descend(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(head);
+    element_t *max = NULL;
+    filter(to_queue(head), true, drop_not_above, &max);
+    return q_size(head);
+}
+
+/* Move the elements of the queue @q, merged into the queue @into, over to it
+ * together with the chunks holding them.
+ */
+static void merge_take(struct list_head *q, struct list_head *into)
+{
+    to_queue(into)->size += to_queue(q)->size;
+    to_queue(q)->size = 0;
+    list_splice_tail_init(&to_queue(q)->chunks, &to_queue(into)->chunks);
+}
+
+/* Merge all the queues into one sorted queue, which is in ascending/descending
+ * order */
+int q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head))
+        return 0;
+    else if (list_is_singular(head))
+        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
+
+    /* The chunks of the other queues are just enough to hold their elements
+     * in the first one, so nothing needs to be allocated.
+     */
+    queue_contex_t *ctx = list_first_entry(head, queue_contex_t, chain);
+    queue_t *first = to_queue(ctx->q);
+    element_merge_chain(head, descend, q_merge_threads, merge_take);
+    refill(first, first->head.next);
+    return first->size;
+}
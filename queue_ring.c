@@ -0,0 +1,727 @@
+#include "queue.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "element.h"
+
+/* Ring buffer implementation of the queue, selected with "make QUEUE=ring".
+ *
+ * Besides the doubly-linked list of elements, which is part of the interface
+ * and walked by the callers, each queue keeps pointers to its elements, in
+ * queue order, in a contiguous ring whose capacity is a power of two. Both
+ * ends are reached in O(1) without touching any neighboring element, and the
+ * i-th element is found by indexing.
+ *
+ * q_merge() must not allocate, so a queue receiving more elements than its
+ * ring can hold marks the ring stale and keeps only the list. The ring is
+ * rebuilt by the next operation that is allowed to allocate, while reverse,
+ * swap, reverseK and sort work on the list in the meantime.
+ */
+
+#define RING_MIN 16
+
+/**
+ * queue_t - Header of a queue
+ * @head: list head handed out to the callers, must be the first member
+ * @size: number of elements in the queue
+ * @slab: element allocator of this queue, NULL to use malloc
+ * @ring: pointers to the elements, the first one at @ring[@first]
+ * @mask: capacity of @ring minus one
+ * @first: index of the first element in @ring
+ * @stale: @ring does not reflect the list
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct slab *slab;
+    element_t **ring;
+    unsigned int mask;
+    unsigned int first;
+    bool stale;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+static inline unsigned int capacity(const queue_t *q)
+{
+    return q->mask + 1;
+}
+
+/* Slot of the @i-th element */
+static inline element_t **at(const queue_t *q, unsigned int i)
+{
+    return &q->ring[(q->first + i) & q->mask];
+}
+
+/* Move the elements to a new ring of @cap slots, or refill it from the list
+ * if the ring is stale.
+ */
+static bool ring_resize(queue_t *q, unsigned int cap)
+{
+    element_t **ring = malloc(cap * sizeof(element_t *));
+    if (!ring)
+        return false;
+    if (q->stale) {
+        unsigned int i = 0;
+        element_t *e;
+        list_for_each_entry (e, &q->head, list)
+            ring[i++] = e;
+        q->stale = false;
+    } else {
+        for (unsigned int i = 0; i < (unsigned int) q->size; i++)
+            ring[i] = *at(q, i);
+    }
+    free(q->ring);
+    q->ring = ring;
+    q->mask = cap - 1;
+    q->first = 0;
+    return true;
+}
+
+/* Make the ring valid and able to hold @n more elements */
+static bool ring_reserve(queue_t *q, unsigned int n)
+{
+    unsigned int need = q->size + n, cap = capacity(q);
+    if (need <= cap && !q->stale)
+        return true;
+    while (cap < need)
+        cap <<= 1;
+    return ring_resize(q, cap);
+}
+
+/* Give back memory once the ring is mostly empty */
+static void ring_shrink(queue_t *q)
+{
+    unsigned int cap = capacity(q);
+    if (cap > RING_MIN && (unsigned int) q->size <= cap / 4)
+        ring_resize(q, cap / 2);
+}
+
+static inline void swap_slots(element_t **a, element_t **b)
+{
+    element_t *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Rebuild the list of elements from the order of the ring */
+static void relink(queue_t *q)
+{
+    struct list_head *prev = &q->head;
+    for (unsigned int i = 0; i < (unsigned int) q->size; i++) {
+        struct list_head *node = &(*at(q, i))->list;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+}
+
+/* Reverse a circular doubly-linked list in place */
+static void list_reverse(struct list_head *head)
+{
+    struct list_head *node = head;
+    do {
+        struct list_head *next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != head);
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+    q->ring = malloc(RING_MIN * sizeof(element_t *));
+    if (!q->ring) {
+        free(q);
+        return NULL;
+    }
+    q->mask = RING_MIN - 1;
+    q->first = 0;
+    q->stale = false;
+    q->size = 0;
+    q->slab = NULL;
+    if (q_use_slab) {
+        q->slab = slab_new();
+        if (!q->slab) {
+            free(q->ring);
+            free(q);
+            return NULL;
+        }
+    }
+    INIT_LIST_HEAD(&q->head);
+    return &q->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+    queue_t *q = to_queue(head);
+    if (q->stale) {
+        struct list_head *node, *safe;
+        list_for_each_safe (node, safe, head) {
+            element_prefetch_walk(safe, head);
+            element_discard(list_entry(node, element_t, list), q->slab);
+        }
+    } else {
+        /* The ring tells which elements come next without loading any */
+        unsigned int n = q->size;
+        for (unsigned int i = 0; i < n; i++) {
+            if (i + PREFETCH_DISTANCE < n)
+                element_prefetch_whole(*at(q, i + PREFETCH_DISTANCE));
+            if (i + PREFETCH_DISTANCE / 2 < n)
+                element_prefetch_value(*at(q, i + PREFETCH_DISTANCE / 2));
+            element_discard(*at(q, i), q->slab);
+        }
+    }
+    if (q->slab)
+        slab_orphan(q->slab);
+    free(q->ring);
+    free(q);
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 1))
+        return false;
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+    q->first = (q->first - 1) & q->mask;
+    q->ring[q->first] = e;
+    list_add(&e->list, head);
+    q->size++;
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 1))
+        return false;
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+    *at(q, q->size) = e;
+    list_add_tail(&e->list, head);
+    q->size++;
+    return true;
+}
+
+/* Insert @n copies of @s at the head or at the tail, carving the elements out
+ * of the slab of the queue if it owns one, or else of a block for this batch
+ * only.
+ */
+static int insert_bulk(struct list_head *head, const char *s, int n, bool tail)
+{
+    if (!head || n < 1)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, n))
+        return 0;
+    struct slab *slab = slab_batch_begin(q->slab, n);
+
+    size_t len = strlen(s) + 1;
+    int cnt = 0;
+    while (cnt < n) {
+        element_t *e = element_new(slab, s, len);
+        if (!e)
+            break;
+        if (tail) {
+            *at(q, q->size) = e;
+            list_add_tail(&e->list, head);
+        } else {
+            q->first = (q->first - 1) & q->mask;
+            q->ring[q->first] = e;
+            list_add(&e->list, head);
+        }
+        q->size++;
+        cnt++;
+    }
+    slab_batch_end(q->slab, slab);
+    return cnt;
+}
+
+/* Insert n copies of a string at head of queue */
+int q_insert_head_bulk(struct list_head *head, char *s, int n)
+{
+    return insert_bulk(head, s, n, false);
+}
+
+/* Insert n copies of a string at tail of queue */
+int q_insert_tail_bulk(struct list_head *head, char *s, int n)
+{
+    return insert_bulk(head, s, n, true);
+}
+
+/* Detach the first element, the ring being valid */
+static element_t *pop_front(queue_t *q)
+{
+    element_t *e = q->ring[q->first];
+    q->first = (q->first + 1) & q->mask;
+    q->size--;
+    list_del(&e->list);
+    return e;
+}
+
+/* Detach the last element, the ring being valid */
+static element_t *pop_back(queue_t *q)
+{
+    element_t *e = *at(q, --q->size);
+    list_del(&e->list);
+    return e;
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return NULL;
+    element_t *e = pop_front(q);
+    element_copy(sp, e, bufsize);
+    ring_shrink(q);
+    return e;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return NULL;
+    element_t *e = pop_back(q);
+    element_copy(sp, e, bufsize);
+    ring_shrink(q);
+    return e;
+}
+
+/* Remove up to n elements from head of queue */
+int q_remove_head_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize)
+{
+    if (!head || list_empty(head) || n < 1)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return 0;
+    int cnt = 0;
+    while (cnt < n && q->size) {
+        element_t *e = pop_front(q);
+        if (sp)
+            element_copy(sp + cnt * bufsize, e, bufsize);
+        list_add_tail(&e->list, list);
+        cnt++;
+    }
+    ring_shrink(q);
+    return cnt;
+}
+
+/* Remove up to n elements from tail of queue */
+int q_remove_tail_n(struct list_head *head,
+                    struct list_head *list,
+                    int n,
+                    char *sp,
+                    size_t bufsize)
+{
+    if (!head || list_empty(head) || n < 1)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return 0;
+    LIST_HEAD(run);
+    int cnt = 0;
+    while (cnt < n && q->size) {
+        element_t *e = pop_back(q);
+        if (sp)
+            element_copy(sp + cnt * bufsize, e, bufsize);
+        list_add(&e->list, &run);
+        cnt++;
+    }
+    list_splice_tail(&run, list);
+    ring_shrink(q);
+    return cnt;
+}
+
+/* Release every element on a list */
+void q_release_list(struct list_head *list)
+{
+    if (!list)
+        return;
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, list) {
+        element_prefetch_walk(safe, list);
+        q_release_element(list_entry(node, element_t, list));
+    }
+    INIT_LIST_HEAD(list);
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+    return to_queue(head)->size;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    /* The middle node is the ((size / 2) + 1)th one, counting from 1 */
+    return q_delete_at(head, q_size(head) / 2);
+}
+
+/* Return the element at a position of the queue */
+element_t *q_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return NULL;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return NULL;
+    return *at(q, i);
+}
+
+/* Delete the element at a position of the queue */
+bool q_delete_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return false;
+    element_t *e = *at(q, i);
+
+    /* Close the gap from the shorter side */
+    if (i < q->size / 2) {
+        for (unsigned int j = i; j > 0; j--)
+            *at(q, j) = *at(q, j - 1);
+        q->first = (q->first + 1) & q->mask;
+    } else {
+        for (unsigned int j = i; j + 1 < (unsigned int) q->size; j++)
+            *at(q, j) = *at(q, j + 1);
+    }
+    q->size--;
+
+    list_del(&e->list);
+    q_release_element(e);
+    return true;
+}
+
+/* Insert an element at a position of the queue */
+bool q_insert_at(struct list_head *head, int i, char *s)
+{
+    if (!head || i < 0 || i > to_queue(head)->size)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 1))
+        return false;
+    element_t *e = element_new(q->slab, s, strlen(s) + 1);
+    if (!e)
+        return false;
+    list_add_tail(&e->list, i < q->size ? &(*at(q, i))->list : head);
+
+    /* Open a gap on the shorter side */
+    if (i < q->size / 2) {
+        q->first = (q->first - 1) & q->mask;
+        for (unsigned int j = 0; j < (unsigned int) i; j++)
+            *at(q, j) = *at(q, j + 1);
+    } else {
+        for (unsigned int j = q->size; j > (unsigned int) i; j--)
+            *at(q, j) = *at(q, j - 1);
+    }
+    *at(q, i) = e;
+    q->size++;
+    return true;
+}
+
+/* Release the element in slot @i */
+static void drop(queue_t *q, unsigned int i)
+{
+    element_t *e = *at(q, i);
+    list_del(&e->list);
+    q_release_element(e);
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return false;
+
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return false;
+    unsigned int n = q->size, w = 0;
+
+    /* Count the copies of each string, then drop those of the strings seen
+     * more than once, compacting towards the tail. Going backwards, the first
+     * copy, which the set compares against, is the last one released.
+     */
+    if (q_dedup_hash) {
+        struct dup_set set;
+        if (!dup_set_init(&set, n))
+            return false;
+        for (unsigned int i = 0; i < n; i++)
+            dup_set_add(&set, *at(q, i));
+        w = n;
+        for (unsigned int i = n; i-- > 0;) {
+            if (dup_set_find(&set, *at(q, i))->count > 1)
+                drop(q, i);
+            else
+                *at(q, --w) = *at(q, i);
+        }
+        dup_set_exit(&set);
+        q->first = (q->first + w) & q->mask;
+        q->size = n - w;
+        return true;
+    }
+
+    bool dup = false;
+    for (unsigned int i = 0; i < n; i++) {
+        bool next_dup = i + 1 < n && element_equal(*at(q, i), *at(q, i + 1));
+        if (dup || next_dup)
+            drop(q, i);
+        else
+            *at(q, w++) = *at(q, i);
+        dup = next_dup;
+    }
+    q->size = w;
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    if (q->stale) {
+        struct list_head *node = head->next;
+        while (node != head && node->next != head) {
+            list_move(node, node->next);
+            node = node->next;
+        }
+        return;
+    }
+    for (unsigned int i = 0; i + 1 < (unsigned int) q->size; i += 2)
+        swap_slots(at(q, i), at(q, i + 1));
+    relink(q);
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    list_reverse(head);
+    if (q->stale)
+        return;
+    for (unsigned int i = 0, j = q->size - 1; i < j; i++, j--)
+        swap_slots(at(q, i), at(q, j));
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || list_empty(head) || list_is_singular(head) || k < 2)
+        return;
+
+    queue_t *q = to_queue(head);
+    if (q->stale) {
+        struct list_head *prev = head;
+        for (int groups = q->size / k; groups; groups--) {
+            /* Move each node of the group right after the one before it */
+            struct list_head *first = prev->next;
+            for (int i = 1; i < k; i++)
+                list_move(first->next, prev);
+            prev = first;
+        }
+        return;
+    }
+    unsigned int end = q->size - q->size % k;
+    for (unsigned int base = 0; base < end; base += k) {
+        for (unsigned int i = base, j = base + k - 1; i < j; i++, j--)
+            swap_slots(at(q, i), at(q, j));
+    }
+    relink(q);
+}
+
+/* Run length sorted by insertion before merging */
+#define RUN_LEN 32
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    if (q->stale) {
+        element_list_sort(head, descend);
+        return;
+    }
+
+    /* Sort runs of consecutive slots, then merge them as lists linked
+     * through the elements and store the result back in the ring.
+     */
+    struct list_head *pending[MERGE_PENDING] = {NULL};
+    for (unsigned int base = 0; base < (unsigned int) q->size;
+         base += RUN_LEN) {
+        unsigned int n = q->size - base < RUN_LEN ? q->size - base : RUN_LEN;
+        element_t *run[RUN_LEN];
+        for (unsigned int i = 0; i < n; i++)
+            run[i] = *at(q, base + i);
+        element_sort_slots(run, n, descend);
+        for (unsigned int i = 0; i < n; i++)
+            run[i]->list.next = i + 1 < n ? &run[i + 1]->list : NULL;
+        merge_add_run(pending, &run[0]->list, descend);
+    }
+    struct list_head *node = merge_pending(pending, descend);
+    for (unsigned int i = 0; i < (unsigned int) q->size; i++) {
+        *at(q, i) = list_entry(node, element_t, list);
+        node = node->next;
+    }
+    relink(q);
+}
+
+/* Shuffle the queue uniformly at random */
+bool q_shuffle(struct list_head *head, uint64_t seed)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return false;
+
+    /* Fisher-Yates on the ring itself */
+    uint64_t state = rng_seed(seed);
+    for (unsigned int i = q->size; i > 1; i--)
+        swap_slots(at(q, i - 1), at(q, rng_below(&state, i)));
+    relink(q);
+    return true;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(head);
+
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return q_size(head);
+    unsigned int n = q->size, w = 1;
+    element_t *max = *at(q, 0);
+    for (unsigned int i = 1; i < n; i++) {
+        element_t *e = *at(q, i);
+        if (element_cmp(e, max) > 0) {
+            max = e;
+            *at(q, w++) = e;
+        } else {
+            drop(q, i);
+        }
+    }
+    q->size = w;
+    return q_size(head);
+}
+
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it */
+int q_descend(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(head);
+
+    /* Walk from the tail, packing the survivors towards it */
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q, 0))
+        return q_size(head);
+    unsigned int n = q->size, w = n - 1;
+    element_t *max = *at(q, n - 1);
+    for (unsigned int i = n - 1; i-- > 0;) {
+        element_t *e = *at(q, i);
+        if (element_cmp(e, max) > 0) {
+            max = e;
+            *at(q, --w) = e;
+        } else {
+            drop(q, i);
+        }
+    }
+    q->first = (q->first + w) & q->mask;
+    q->size = n - w;
+    return q_size(head);
+}
+
+/* Move the size of the queue @q, merged into the queue @into, over to it. The
+ * ring of @into no longer matches its list, q_merge() rebuilds the one of the
+ * first queue at the end.
+ */
+static void merge_take(struct list_head *q, struct list_head *into)
+{
+    to_queue(into)->size += to_queue(q)->size;
+    to_queue(into)->stale = true;
+    to_queue(q)->size = 0;
+    to_queue(q)->first = 0;
+    to_queue(q)->stale = false;
+}
+
+/* Merge all the queues into one sorted queue, which is in ascending/descending
+ * order */
+int q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head))
+        return 0;
+    else if (list_is_singular(head))
+        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
+
+    queue_contex_t *ctx = list_first_entry(head, queue_contex_t, chain);
+    queue_t *first = to_queue(ctx->q);
+    element_merge_chain(head, descend, q_merge_threads, merge_take);
+
+    /* Growing the ring would allocate, leave that to the next operation */
+    if ((unsigned int) first->size > capacity(first)) {
+        first->stale = true;
+        return first->size;
+    }
+    unsigned int i = 0;
+    element_t *e;
+    first->first = 0;
+    first->stale = false;
+    list_for_each_entry (e, &first->head, list)
+        first->ring[i++] = e;
+    return first->size;
+}
@@ -0,0 +1,47 @@
+#!/usr/bin/env bash
+
+# Build qtest once per queue implementation and report how long each of them
+# takes to run the performance traces.
+#
+# Usage: scripts/compare-backends.sh [implementation...]
+# The implementations default to "list chunk ring", see QUEUE in Makefile.
+
+cd "$(dirname "$0")/.." || exit 1
+
+BACKENDS=${*:-list chunk ring}
+TRACES="traces/trace-14-perf.cmd traces/trace-15-perf.cmd
+        traces/trace-16-perf.cmd traces/trace-17-complexity.cmd
+        traces/bench-fifo.cmd traces/bench-reverseK.cmd"
+
+TMPDIR=$(mktemp -d /tmp/qtest.XXXXXX) || exit 1
+trap 'rm -rf "$TMPDIR"' EXIT
+
+for b in $BACKENDS; do
+  make -s QUEUE="$b" qtest > /dev/null || exit 1
+  cp qtest "$TMPDIR/qtest-$b"
+done
+# Leave the default implementation built
+make -s qtest > /dev/null
+
+printf "%-22s" "trace"
+for b in $BACKENDS; do
+  printf "%10s" "$b"
+done
+printf "\n"
+
+# Elapsed seconds, marked with '!' when the trace failed
+for t in $TRACES; do
+  printf "%-22s" "$(basename "$t" .cmd)"
+  for b in $BACKENDS; do
+    start=$(date +%s%N)
+    if "$TMPDIR/qtest-$b" -v 0 -f "$t" > /dev/null 2>&1; then
+      mark=" "
+    else
+      mark="!"
+    fi
+    end=$(date +%s%N)
+    ms=$(((end - start) / 1000000))
+    printf "%9s%s" "$((ms / 1000)).$(printf "%03d" $((ms % 1000)))" "$mark"
+  done
+  printf "\n"
+done
@@ -0,0 +1,12 @@
+# Compare 'q_insert_head', 'q_insert_tail', 'q_remove_head', and 'q_remove_tail' throughput of the queue implementations
+option fail 0
+option malloc 0
+new
+it dolphin 1000000
+rh dolphin 1000000
+ih gerbil 1000000
+rh gerbil 1000000
+it jaguar 500000
+ih jaguar 500000
+rt jaguar 1000000
+free
@@ -0,0 +1,28 @@
+# Compare 'q_reverseK' throughput with small groups on a million elements
+option fail 0
+option malloc 0
+# Sort and merge four quarters to scatter the nodes in memory, as after real
+# use, with each step well within the time limit
+new
+it RAND 250000
+sort
+new
+it RAND 250000
+sort
+new
+it RAND 250000
+sort
+new
+it RAND 250000
+sort
+merge
+time
+reverseK 2
+time
+reverseK 3
+time
+reverseK 8
+time
+reverseK 1000
+time
+free